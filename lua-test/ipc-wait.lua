@@ -0,0 +1,27 @@
+--  ipc:wait: ,   ,  
+-- ,  wait()   -   true   
+
+local w32 = require("w32")
+
+function main()
+	local ipc, err = w32.CreateIpcWindow("w32-test-ipc-wait")
+	if not ipc then
+		message("CreateIpcWindow failed: " .. tostring(err))
+		return
+	end
+
+	--   ,   
+	w32.SendCopyData(ipc:hwnd(), 1, "first")
+	local ids, payloads, n = ipc:read()
+	message("read: n=" .. n .. (n == 1 and payloads[1] == "first" and " OK" or " FAILED"))
+
+	--  :   
+	local ready = ipc:wait(100)
+	message("wait on empty ring: " .. tostring(ready) .. (not ready and " OK" or " FAILED"))
+
+	--     
+	w32.SendCopyData(ipc:hwnd(), 2, "second")
+	message("wait with data: " .. (ipc:wait(100) and "OK" or "FAILED"))
+
+	ipc:close()
+end
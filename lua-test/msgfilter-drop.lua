@@ -0,0 +1,34 @@
+--  SetMessageFilter   "drop": WM_PAINT    
+-- PeekMessage,    ,     ,
+--  PumpMessages  GetMessage 
+
+local w32 = require("w32")
+
+function main()
+	--     ,        
+	local hwnd = w32.CreateWindowEx(w32.WS_EX_TOOLWINDOW + w32.WS_EX_NOACTIVATE, "STATIC", "",
+	                                w32.WS_POPUP + w32.WS_VISIBLE, 0, 0, 1, 1)
+	if hwnd == 0 then
+		message("CreateWindowEx failed")
+		return
+	end
+
+	w32.SetMessageFilter({w32.WM_USER}, "drop")
+
+	--     , WM_PAINT    
+	w32.InvalidateRect(hwnd)
+	local n, quit = w32.PumpMessages(nil, 0)
+	message("drain: dispatched=" .. n .. " quit=" .. tostring(quit))
+	n = w32.PumpMessages(nil, 0)
+	message("drain again: dispatched=" .. n .. (n == 0 and " OK" or " FAILED"))
+
+	-- GetMessage    WM_PAINT    
+	w32.InvalidateRect(hwnd)
+	w32.PostMessage(hwnd, w32.WM_USER + 1, 0, 0)
+	w32.PostMessage(hwnd, w32.WM_USER, 0, 0)
+	local rc, h, msg = w32.GetMessage(hwnd)
+	message("GetMessage: " .. ((rc ~= 0 and msg == w32.WM_USER) and "OK" or "FAILED"))
+
+	w32.SetMessageFilter(nil)
+	w32.DestroyWindow(hwnd)
+end
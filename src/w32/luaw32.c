@@ -61,6 +61,7 @@
 
 #include <shlwapi.h>
 #include <shlobj.h>
+#include <commctrl.h>
 
 #if LUA_VERSION_NUM <= 502
 #define LS_NAMESPACE    "w32"
@@ -89,6 +90,227 @@
 #define	lua_pushint64(L, n)     lua_pushnumber(L, n)
 #endif
 
+#if LUA_VERSION_NUM >= 502
+#define	lua_setfuncs(L, l)      luaL_setfuncs(L, l, 0)
+#else
+#define	lua_setfuncs(L, l)      luaL_register(L, NULL, l)
+#define	lua_rawlen(L, n)        lua_objlen(L, n)
+#endif
+
+// window handles are passed through lua_Integer without truncation on x64
+#define	lua_checkhwnd(L, n)     ((HWND)(INT_PTR)luaL_checkinteger(L, n))
+#define	lua_pushhwnd(L, h)      lua_pushinteger(L, (lua_Integer)(INT_PTR)(h))
+
+/* Userdata classes: metatable is its own __index */
+
+static void NewClass(lua_State *L, const char *name, const luaL_Reg *methods) {
+	luaL_newmetatable(L, name);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_setfuncs(L, methods);
+	lua_pop(L, 1);
+}
+
+// returns userdata at idx when its metatable is tname, otherwise NULL
+static void *TestUdata(lua_State *L, int idx, const char *tname) {
+	void *p = lua_touserdata(L, idx);
+
+	if (p == NULL || !lua_getmetatable(L, idx))
+		return NULL;
+	luaL_getmetatable(L, tname);
+	if (!lua_rawequal(L, -1, -2))
+		p = NULL;
+	lua_pop(L, 2);
+
+	return p;
+}
+
+/* Script encoding: 0 - ANSI API as is, otherwise code page of the script strings for W API */
+
+#define ENCODING_KEY    "w32.encoding"
+#define WSTR_BUFSIZE    256
+
+static const char *const encodingNames[] = {"ansi", "utf8", "cp1251", NULL};
+static const UINT encodingCodePages[] = {0, CP_UTF8, 1251};
+
+// the encoding is kept per Lua state, every QUIK script chooses its own
+static UINT GetScriptCodePage(lua_State *L) {
+	UINT cp;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, ENCODING_KEY);
+	cp = (UINT)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+
+	return cp;
+}
+
+static BOOL IsAscii(const char *s, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (s[i] & 0x80)
+			return FALSE;
+
+	return TRUE;
+}
+
+struct S_WSTR {
+	WCHAR *p;
+	int len;
+	WCHAR buf[WSTR_BUFSIZE];
+};
+
+// converts script string to UTF-16, ASCII is widened without the API call
+static BOOL ToWide(UINT cp, const char *s, size_t len, struct S_WSTR *w) {
+	int n;
+
+	w->p = w->buf;
+	w->len = 0;
+	if (len < WSTR_BUFSIZE && IsAscii(s, len)) {
+		size_t i;
+		for (i = 0; i < len; i++)
+			w->buf[i] = (WCHAR)s[i];
+		w->buf[len] = 0;
+		w->len = (int)len;
+		return TRUE;
+	}
+
+	n = MultiByteToWideChar(cp, 0, s, (int)len, NULL, 0);
+	if (n <= 0)
+		return FALSE;
+	if (n >= WSTR_BUFSIZE) {
+		WCHAR *p = malloc((n + 1) * sizeof(WCHAR));
+		if (p == NULL)
+			return FALSE;
+		w->p = p;
+	}
+	MultiByteToWideChar(cp, 0, s, (int)len, w->p, n);
+	w->p[n] = 0;
+	w->len = n;
+
+	return TRUE;
+}
+
+static void FreeWide(struct S_WSTR *w) {
+	if (w->p != w->buf)
+		free(w->p);
+	w->p = w->buf;
+}
+
+// pushes UTF-16 text converted to the script code page, nil when out of memory
+static void PushWide(lua_State *L, UINT cp, const WCHAR *s, int len) {
+	char buf[1024];
+	char *p;
+	int i, n;
+
+	if (len <= (int)sizeof(buf)) {
+		for (i = 0; i < len && s[i] < 0x80; i++)
+			buf[i] = (char)s[i];
+		if (i == len) {
+			lua_pushlstring(L, buf, len);
+			return;
+		}
+	}
+
+	n = WideCharToMultiByte(cp, 0, s, len, NULL, 0, NULL, NULL);
+	p = n <= (int)sizeof(buf) ? buf : malloc(n);
+	if (p == NULL) {
+		lua_pushnil(L);
+		return;
+	}
+	WideCharToMultiByte(cp, 0, s, len, p, n, NULL, NULL);
+	lua_pushlstring(L, p, n);
+	if (p != buf)
+		free(p);
+}
+
+// code page for the W API: strings of a script without an encoding are ANSI
+static UINT GetTextCodePage(lua_State *L) {
+	const UINT cp = GetScriptCodePage(L);
+	return cp ? cp : CP_ACP;
+}
+
+// converts script string to UTF-16 kept in a userdata pushed on the stack, so an
+// error raised later does not leak it; NULL or empty s pushes nil and returns NULL
+static const WCHAR *PushWideName(lua_State *L, UINT cp, const char *s) {
+	const int len = s != NULL ? (int)strlen(s) : 0;
+	WCHAR *w;
+	int n;
+
+	n = len > 0 ? MultiByteToWideChar(cp, 0, s, len, NULL, 0) : 0;
+	if (n <= 0) {
+		lua_pushnil(L);
+		return NULL;
+	}
+	w = (WCHAR *)lua_newuserdata(L, (n + 1) * sizeof(WCHAR));
+	MultiByteToWideChar(cp, 0, s, len, w, n);
+	w[n] = 0;
+
+	return w;
+}
+
+// FindWindowEx through the W API, empty class or title means any
+static HWND FindWindowWide(UINT cp, HWND parent, HWND after, const char *cname, const char *wname) {
+	const BOOL hasClass = cname && cname[0];
+	const BOOL hasTitle = wname && wname[0];
+	struct S_WSTR wc, ww;
+	HWND hwnd = NULL;
+
+	wc.p = wc.buf;
+	ww.p = ww.buf;
+	if ((!hasClass || ToWide(cp, cname, strlen(cname), &wc)) &&
+	    (!hasTitle || ToWide(cp, wname, strlen(wname), &ww)))
+		hwnd = FindWindowExW(parent, after, hasClass ? wc.p : NULL, hasTitle ? ww.p : NULL);
+	FreeWide(&wc);
+	FreeWide(&ww);
+
+	return hwnd;
+}
+
+// Lua:  SetScriptEncoding("ansi" | "utf8" | "cp1251"), returns previous encoding
+static int global_SetScriptEncoding(lua_State *L) {
+	const int enc = luaL_checkoption(L, 1, NULL, encodingNames);
+	const UINT prev = GetScriptCodePage(L);
+	int i;
+
+	for (i = 0; encodingNames[i] != NULL && encodingCodePages[i] != prev; i++)
+		;
+	lua_pushstring(L, encodingNames[i] != NULL ? encodingNames[i] : "ansi");
+
+	lua_pushinteger(L, encodingCodePages[enc]);
+	lua_setfield(L, LUA_REGISTRYINDEX, ENCODING_KEY);
+
+	return 1;
+}
+
+// converts string between code pages, ASCII strings are returned as is
+static int ConvertCodePage(lua_State *L, UINT from, UINT to) {
+	size_t len;
+	const char *s = luaL_checklstring(L, 1, &len);
+	struct S_WSTR w;
+
+	if (IsAscii(s, len)) {
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+	if (!ToWide(from, s, len, &w)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	PushWide(L, to, w.p, w.len);
+	FreeWide(&w);
+
+	return 1;
+}
+
+static int global_Utf8ToCp1251(lua_State *L) {
+	return ConvertCodePage(L, CP_UTF8, 1251);
+}
+
+static int global_Cp1251ToUtf8(lua_State *L) {
+	return ConvertCodePage(L, 1251, CP_UTF8);
+}
+
 /* Registered functions */
 
 static int global_ShellOpen(lua_State *L) {
@@ -113,6 +335,12 @@ static int global_FindWindow(lua_State *L) {
 	if(narg > 1)
 		wname = luaL_checkstring(L, 2);
 
+	const UINT cp = GetScriptCodePage(L);
+	if (cp) {
+		lua_pushhwnd(L, FindWindowWide(cp, NULL, NULL, cname, wname));
+		return 1;
+	}
+
     lrc = ( long) FindWindow( cname[0] ? cname : NULL,
 	                          wname && wname[0] ? wname : NULL);
 
@@ -132,6 +360,12 @@ static int global_FindWindowEx(lua_State *L) {
 	if (narg > 3)
 		wname = luaL_checkstring(L, 4);
 
+	const UINT cp = GetScriptCodePage(L);
+	if (cp) {
+		lua_pushhwnd(L, FindWindowWide(cp, parent, childaft, cname, wname));
+		return 1;
+	}
+
     long lrc = ( long) FindWindowEx( parent, childaft,
                                 cname && cname[0] ? cname : NULL,
                                 wname && wname[0] ? wname : NULL);
@@ -141,815 +375,5020 @@ static int global_FindWindowEx(lua_State *L) {
     return( 1);
 }
 
-static int global_SetWindowText(lua_State *L) {
-    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
-    const char *text = luaL_checkstring( L, 2);
-
-    BOOL rc = SetWindowText( hwnd, text);
-
-    lua_pushnumber( L, rc);
+/* Direct children walked once in Z order, the same order FindWindowEx returns them */
 
-    return( 1);
+// parent 0 means desktop, as for FindWindowEx
+static HWND FirstChild(HWND parent) {
+	return GetWindow(parent != NULL ? parent : GetDesktopWindow(), GW_CHILD);
 }
 
-static int global_SetFocus(lua_State *L) {
-    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
-    HWND rc = SetFocus( hwnd);
-    lua_pushinteger( L, (int)rc);
+// class: NULL - any
+static BOOL IsChildOfClass(HWND hwnd, const WCHAR *cname) {
+	WCHAR buf[256];
 
-    return( 1);
-}
+	if (cname == NULL)
+		return TRUE;
 
-// Lua:  returns nil when error occurred
-static int global_GetWindowText(lua_State *L) {
-    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
-    char buf[2048];
+	return GetClassNameW(hwnd, buf, sizeof(buf) / sizeof(buf[0])) && lstrcmpiW(buf, cname) == 0;
+}
 
-    int rc = GetWindowText( hwnd, buf, sizeof(buf));
+// Lua:  GetChildWindows(parent, {class = "", visible = false, max = 0})
+//       returns array of direct children and their number
+static int global_GetChildWindows(lua_State *L) {
+	const HWND parent = lua_checkhwnd(L, 1);
+	const WCHAR *cname = NULL;
+	BOOL visible = FALSE;
+	int max = 0, n = 0;
+	HWND hwnd;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "class");
+		cname = PushWideName(L, GetTextCodePage(L), lua_tostring(L, -1));  // stays on the stack while walking
+		lua_getfield(L, 2, "visible");
+		visible = lua_toboolean(L, -1);
+		lua_getfield(L, 2, "max");
+		max = (int)lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	}
 
-    if (rc > 0)
-        lua_pushstring( L, buf);
-    else if (GetLastError() == ERROR_SUCCESS)
-        lua_pushstring( L, "");
-    else
-        lua_pushnil( L);
+	lua_newtable(L);
+	for (hwnd = FirstChild(parent); hwnd != NULL && (max <= 0 || n < max);
+	     hwnd = GetWindow(hwnd, GW_HWNDNEXT)) {
+		if (visible && !IsWindowVisible(hwnd))
+			continue;
+		if (!IsChildOfClass(hwnd, cname))
+			continue;
+		lua_pushhwnd(L, hwnd);
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_pushinteger(L, n);
 
-    return( 1);
+	return 2;
 }
 
-// Lua:  returns left,top,right,bottom when successfully
-//         or
-//       returns nil when error occurred
-static int global_GetWindowRect(lua_State *L) {
-    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
-    RECT rect;
-
-    BOOL rc = GetWindowRect( hwnd, &rect);
-
-	if (!rc) {
-        lua_pushnil( L);
-        return( 1);
+// Lua:  GetChildByIndex(parent, n, class), n is 1-based among children of the class
+//       returns hwnd or 0 when not found
+static int global_GetChildByIndex(lua_State *L) {
+	const HWND parent = lua_checkhwnd(L, 1);
+	int n = (int)luaL_checkinteger(L, 2);
+	const WCHAR *cname = PushWideName(L, GetTextCodePage(L), luaL_optstring(L, 3, NULL));
+	HWND hwnd = NULL;
+
+	if (n > 0) {
+		for (hwnd = FirstChild(parent); hwnd != NULL; hwnd = GetWindow(hwnd, GW_HWNDNEXT))
+			if (IsChildOfClass(hwnd, cname) && --n == 0)
+				break;
 	}
-	else {
-        lua_pushinteger( L, rect.left);
-        lua_pushinteger( L, rect.top);
-        lua_pushinteger( L, rect.right);
-        lua_pushinteger( L, rect.bottom);
-	    return( 4);
-    }
+	lua_pushhwnd(L, hwnd);
+
+	return 1;
 }
 
-struct S_HKT {
-    HWND hwnd;
-    int id;
-    UINT mdfs;
-    UINT vk;
-    UINT umsg;
-    WPARAM wparam;
-    LPARAM lparam;
+/* Window list filled by EnumWindows/EnumChildWindows in one native pass */
+
+struct S_HWNDLIST {
+	HWND *items;
+	int count;
+	int capacity;
 };
 
-static void HotKeyThread( void *v) {
-    struct S_HKT *s = ( struct S_HKT *) v;
-    MSG msg;
+static BOOL CALLBACK CollectWindowProc(HWND hwnd, LPARAM lparam) {
+	struct S_HWNDLIST *list = (struct S_HWNDLIST *)lparam;
 
-    RegisterHotKey( NULL, s->id, s->mdfs, s->vk);
+	if (list->count == list->capacity) {
+		const int capacity = list->capacity ? list->capacity * 2 : 256;
+		HWND *items = realloc(list->items, capacity * sizeof(HWND));
+		if (items == NULL)
+			return FALSE;
+		list->items = items;
+		list->capacity = capacity;
+	}
+	list->items[list->count++] = hwnd;
 
-    while( GetMessage( &msg, NULL, 0, 0) > 0)
-        if( msg.message == WM_HOTKEY)
-            PostMessage( s->hwnd, s->umsg, s->wparam, s->lparam);
+	return TRUE;
 }
 
-static int global_RegisterHotKey(lua_State *L) {
-    struct S_HKT *s;
-
-    s = malloc( sizeof( struct S_HKT));
-    if( s == NULL)
-        lua_pushnumber( L, -1);
-    else {
-        long hwnd = MYP2HCAST luaL_checknumber( L, 1);
-        s->hwnd = ( HWND) hwnd;
-        s->id = ( int) luaL_checknumber( L, 2);
-        s->mdfs = ( UINT) luaL_checknumber( L, 3);
-        s->vk = ( UINT) luaL_checknumber( L, 4);
-        s->umsg = ( UINT) luaL_checknumber( L, 5);
-        s->wparam = ( WPARAM) luaL_checknumber( L, 6);
-        s->lparam = ( LPARAM) luaL_checknumber( L, 7);
-
-        if( _beginthread( HotKeyThread, 0, s) < 0)
-            lua_pushnumber( L, -2);
-        else
-            lua_pushnumber( L, 0);
-    }
+// parent == NULL: top-level windows, otherwise all descendants of parent
+static void CollectWindows(HWND parent, struct S_HWNDLIST *list) {
+	list->items = NULL;
+	list->count = 0;
+	list->capacity = 0;
 
-    return( 1);
+	if (parent == NULL)
+		EnumWindows(CollectWindowProc, (LPARAM)list);
+	else
+		EnumChildWindows(parent, CollectWindowProc, (LPARAM)list);
 }
 
-static int global_SetForegroundWindow(lua_State *L) {
-	auto hwnd = luaL_checkinteger(L, 1);
-	BOOL rc = SetForegroundWindow((HWND)hwnd);
-	lua_pushinteger(L, rc == TRUE);
+static void FreeWindowList(struct S_HWNDLIST *list) {
+	free(list->items);
+	list->items = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
 
-	return 1;
+#define SNAP_CLASS      0x01
+#define SNAP_TEXT       0x02
+#define SNAP_PID        0x04
+#define SNAP_TID        0x08
+#define SNAP_VISIBLE    0x10
+#define SNAP_RECT       0x20
+#define SNAP_ALL        0x3F
+
+static const struct {
+	const char *name;
+	int flag;
+} snapFields[] = {
+	{"hwnd", 0},
+	{"class", SNAP_CLASS},
+	{"text", SNAP_TEXT},
+	{"pid", SNAP_PID},
+	{"tid", SNAP_TID},
+	{"visible", SNAP_VISIBLE},
+	{"rect", SNAP_RECT},
+	{NULL, 0}
+};
+
+// fields: string like "class,pid,visible"; nil means all fields
+static int CheckSnapshotFields(lua_State *L, int narg) {
+	static const char sep[] = " ,;";
+	const char *s;
+	int flags = 0;
+
+	if (lua_isnoneornil(L, narg))
+		return SNAP_ALL;
+
+	s = luaL_checkstring(L, narg);
+	s += strspn(s, sep);
+	while (*s) {
+		const size_t len = strcspn(s, sep);
+		int i;
+		for (i = 0; snapFields[i].name != NULL; i++)
+			if (strlen(snapFields[i].name) == len && strncmp(snapFields[i].name, s, len) == 0)
+				break;
+		if (snapFields[i].name == NULL)
+			return luaL_argerror(L, narg, "unknown field name");
+		flags |= snapFields[i].flag;
+		s += len;
+		s += strspn(s, sep);
+	}
+
+	return flags;
 }
 
-static int global_PostMessage(lua_State *L) {
-	auto hwnd = lua_checkint64(L, 1);
-	UINT msg = (UINT)lua_checkint64(L, 2);
-	WPARAM wparam = (WPARAM)lua_checkint64(L, 3);
-	LPARAM lparam = (LPARAM)lua_checkint64(L, 4);
+// Lua:  EnumWindowsSnapshot(parent, fields)
+//       returns columnar table {n=, hwnd={}, class={}, text={}, pid={}, tid={},
+//                               visible={}, left={}, top={}, right={}, bottom={}}
+static int global_EnumWindowsSnapshot(lua_State *L) {
+	const HWND parent = (HWND)(INT_PTR)luaL_optinteger(L, 1, 0);
+	const int fields = CheckSnapshotFields(L, 2);
+	const UINT cp = GetTextCodePage(L);
+	struct S_HWNDLIST list;
+	int i;
 
-    BOOL rc = PostMessage((HWND)hwnd, msg, wparam, lparam);
+	CollectWindows(parent, &list);
 
-	lua_pushboolean(L, rc == TRUE);
+	lua_createtable(L, 0, 11);
+	lua_pushinteger(L, list.count);
+	lua_setfield(L, -2, "n");
 
-    return 1;
-}
+	lua_createtable(L, list.count, 0);
+	for (i = 0; i < list.count; i++) {
+		lua_pushhwnd(L, list.items[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "hwnd");
+
+	if (fields & SNAP_CLASS) {
+		WCHAR buf[256];
+		lua_createtable(L, list.count, 0);
+		for (i = 0; i < list.count; i++) {
+			const int len = GetClassNameW(list.items[i], buf, sizeof(buf) / sizeof(buf[0]));
+			PushWide(L, cp, buf, len > 0 ? len : 0);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "class");
+	}
 
-static int global_SendMessage(lua_State *L) {
-	auto hwnd = lua_checkint64(L, 1);
-	UINT msg = (UINT)lua_checkint64(L, 2);
-	WPARAM wparam = (WPARAM)lua_checkint64(L, 3);
-	LPARAM lparam = (LPARAM)lua_checkint64(L, 4);
+	if (fields & SNAP_TEXT) {
+		WCHAR buf[2048];
+		lua_createtable(L, list.count, 0);
+		for (i = 0; i < list.count; i++) {
+			const int len = GetWindowTextW(list.items[i], buf, sizeof(buf) / sizeof(buf[0]));
+			PushWide(L, cp, buf, len > 0 ? len : 0);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "text");
+	}
 
-	LRESULT rc = SendMessage((HWND)hwnd, msg, wparam, lparam);
+	if (fields & (SNAP_PID | SNAP_TID)) {
+		lua_createtable(L, list.count, 0);
+		lua_createtable(L, list.count, 0);
+		for (i = 0; i < list.count; i++) {
+			DWORD pid = 0;
+			const DWORD tid = GetWindowThreadProcessId(list.items[i], &pid);
+			lua_pushinteger(L, (lua_Integer)pid);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushinteger(L, (lua_Integer)tid);
+			lua_rawseti(L, -2, i + 1);
+		}
+		if (fields & SNAP_TID)
+			lua_setfield(L, -3, "tid");
+		else
+			lua_pop(L, 1);
+		if (fields & SNAP_PID)
+			lua_setfield(L, -2, "pid");
+		else
+			lua_pop(L, 1);
+	}
 
-	lua_pushint64(L, rc);
+	if (fields & SNAP_VISIBLE) {
+		lua_createtable(L, list.count, 0);
+		for (i = 0; i < list.count; i++) {
+			lua_pushboolean(L, IsWindowVisible(list.items[i]));
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "visible");
+	}
+
+	if (fields & SNAP_RECT) {
+		lua_createtable(L, list.count, 0);
+		lua_createtable(L, list.count, 0);
+		lua_createtable(L, list.count, 0);
+		lua_createtable(L, list.count, 0);
+		for (i = 0; i < list.count; i++) {
+			RECT rect;
+			if (!GetWindowRect(list.items[i], &rect))
+				memset(&rect, 0, sizeof(rect));
+			lua_pushinteger(L, rect.left);
+			lua_rawseti(L, -5, i + 1);
+			lua_pushinteger(L, rect.top);
+			lua_rawseti(L, -4, i + 1);
+			lua_pushinteger(L, rect.right);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushinteger(L, rect.bottom);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -5, "bottom");
+		lua_setfield(L, -4, "right");
+		lua_setfield(L, -3, "top");
+		lua_setfield(L, -2, "left");
+	}
+
+	FreeWindowList(&list);
 
 	return 1;
 }
 
-static int global_PostThreadMessage(lua_State *L) {
-    BOOL rc;
-    DWORD tid = ( DWORD)luaL_checkinteger(L, 1);
-    UINT msg = ( UINT)luaL_checkinteger(L, 2);
-    WPARAM wparam = ( WPARAM)luaL_checkinteger(L, 3);
-    LPARAM lparam = ( LPARAM)luaL_checkinteger(L, 4);
+/* Window predicates applied inside the enumeration callback */
 
-    rc = PostThreadMessage( tid, msg, wparam, lparam);
+struct S_WNDFILTER {
+	DWORD pid;              // 0 - any process
+	const WCHAR *cname;     // NULL - any class
+	const WCHAR *wname;     // NULL - any title
+	BOOL first;             // stop at first match
+	struct S_HWNDLIST list;
+};
 
-	lua_pushinteger( L, rc);
+static BOOL MatchWindow(HWND hwnd, const struct S_WNDFILTER *f) {
+	WCHAR buf[2048];
 
-    return( 1);
+	if (f->pid) {
+		DWORD pid = 0;
+		GetWindowThreadProcessId(hwnd, &pid);
+		if (pid != f->pid)
+			return FALSE;
+	}
+	if (f->cname) {
+		if (!GetClassNameW(hwnd, buf, sizeof(buf) / sizeof(buf[0])) || lstrcmpiW(buf, f->cname) != 0)
+			return FALSE;
+	}
+	if (f->wname) {
+		if (GetWindowTextW(hwnd, buf, sizeof(buf) / sizeof(buf[0])) <= 0)
+			buf[0] = 0;
+		if (wcscmp(buf, f->wname) != 0)
+			return FALSE;
+	}
+
+	return TRUE;
 }
 
-static int global_GetMessage(lua_State *L) {
-    MSG msg;
-    BOOL rc;
-    long lwnd = MYP2HCAST luaL_optinteger( L, 1, 0);
-    UINT mfmin = ( UINT) luaL_optinteger( L, 2, 0);
-    UINT mfmax = ( UINT) luaL_optinteger( L, 3, 0);
+static BOOL CALLBACK FilterWindowProc(HWND hwnd, LPARAM lparam) {
+	struct S_WNDFILTER *f = (struct S_WNDFILTER *)lparam;
 
-    rc = GetMessage( &msg, ( HWND) lwnd, mfmin, mfmax);
+	if (!MatchWindow(hwnd, f))
+		return TRUE;
+	if (!CollectWindowProc(hwnd, (LPARAM)&f->list))
+		return FALSE;
 
-    lua_pushnumber( L, rc);
-    if( rc) {
-        lua_pushnumber( L, ( long) msg.hwnd);
-        lua_pushnumber( L, msg.message);
-        lua_pushnumber( L, msg.wParam);
-        lua_pushnumber( L, msg.lParam);
-        lua_pushnumber( L, msg.time);
-        lua_pushnumber( L, msg.pt.x);
-        lua_pushnumber( L, msg.pt.y);
-    } else {
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-    }
+	return !f->first;
+}
 
-    return( 8);
+// Lua:  FindWindowsByProcess(pid, class, title, first)
+//       pid 0 or nil means current process; empty class/title means any
+//       returns hwnd (0 if not found) when first is true,
+//       otherwise array of all matching top-level windows
+static int global_FindWindowsByProcess(lua_State *L) {
+	struct S_WNDFILTER f;
+	const UINT cp = GetTextCodePage(L);
+	int i;
+
+	f.pid = (DWORD)luaL_optinteger(L, 1, 0);
+	if (f.pid == 0)
+		f.pid = GetCurrentProcessId();
+	f.cname = PushWideName(L, cp, luaL_optstring(L, 2, NULL));
+	f.wname = PushWideName(L, cp, luaL_optstring(L, 3, NULL));
+	f.first = lua_toboolean(L, 4);
+	memset(&f.list, 0, sizeof(f.list));
+
+	EnumWindows(FilterWindowProc, (LPARAM)&f);
+
+	if (f.first) {
+		lua_pushhwnd(L, f.list.count > 0 ? f.list.items[0] : NULL);
+	}
+	else {
+		lua_createtable(L, f.list.count, 0);
+		for (i = 0; i < f.list.count; i++) {
+			lua_pushhwnd(L, f.list.items[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+	}
+
+	FreeWindowList(&f.list);
+
+	return 1;
 }
 
-static int global_PeekMessage(lua_State *L) {
-    MSG msg;
-    BOOL rc;
-    long lwnd = MYP2HCAST luaL_optinteger( L, 1, 0);
-    UINT mfmin = ( UINT) luaL_optinteger( L, 2, 0);
-    UINT mfmax = ( UINT) luaL_optinteger( L, 3, 0);
-    UINT rmmsg = ( UINT) luaL_optinteger( L, 4, PM_NOREMOVE);
+/* WinEvent service thread: counts window tree and layout change events */
 
-    rc = PeekMessage( &msg, ( HWND) lwnd, mfmin, mfmax, rmmsg);
+#define WE_SYNCLAYOUT   (WM_APP + 1)   // thread message: layout hooks follow the tracker count
 
-    lua_pushnumber( L, rc);
-    if( rc) {
-        lua_pushnumber( L, ( long) msg.hwnd);
-        lua_pushnumber( L, msg.message);
-        lua_pushnumber( L, msg.wParam);
-        lua_pushnumber( L, msg.lParam);
-        lua_pushnumber( L, msg.time);
-        lua_pushnumber( L, msg.pt.x);
-        lua_pushnumber( L, msg.pt.y);
-    } else {
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
-    }
+static struct {
+	volatile LONG generation;       // window created, destroyed or renamed
+	volatile LONG layoutGeneration; // window shown, hidden, moved or resized
+	volatile LONG layoutHooked;     // layout events are counted, only while trackers exist
+	volatile LONG trackers;         // alive window trackers
+	DWORD tid;
+	BOOL running;
+} winEvents;
+
+static INIT_ONCE winEventsOnce = INIT_ONCE_STATIC_INIT;
+
+// waiters for a generation change sleep on winEventsCond
+static SRWLOCK winEventsLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE winEventsCond = CONDITION_VARIABLE_INIT;
+
+static void CALLBACK WinEventProc(HWINEVENTHOOK hook, DWORD event, HWND hwnd,
+                                  LONG idObject, LONG idChild, DWORD tid, DWORD time) {
+	if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF)
+		return;
+
+	switch (event) {
+	case EVENT_OBJECT_CREATE:
+	case EVENT_OBJECT_DESTROY:
+	case EVENT_OBJECT_NAMECHANGE:
+		InterlockedIncrement(&winEvents.generation);
+		// a waiter checks the generation under the lock, so taking it here
+		// guarantees the waiter is either asleep or will see the new value
+		AcquireSRWLockExclusive(&winEventsLock);
+		ReleaseSRWLockExclusive(&winEventsLock);
+		WakeAllConditionVariable(&winEventsCond);
+		break;
+	default:
+		InterlockedIncrement(&winEvents.layoutGeneration);
+	}
+}
 
-    return( 8);
+// LOCATIONCHANGE fires on every caret and cursor move in the system,
+// so the layout hooks are installed only while a window tracker needs them
+static void SyncLayoutHooks(HWINEVENTHOOK *hShow, HWINEVENTHOOK *hLocation) {
+	if (winEvents.trackers > 0 && *hShow == NULL) {
+		*hShow = SetWinEventHook(EVENT_OBJECT_SHOW, EVENT_OBJECT_HIDE,
+		                         NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+		*hLocation = SetWinEventHook(EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE,
+		                             NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+		// changes made before the hooks were installed are found by the next diff
+		InterlockedIncrement(&winEvents.layoutGeneration);
+		InterlockedExchange(&winEvents.layoutHooked, *hShow != NULL && *hLocation != NULL);
+	}
+	else if (winEvents.trackers == 0 && *hShow != NULL) {
+		InterlockedExchange(&winEvents.layoutHooked, FALSE);
+		UnhookWinEvent(*hShow);
+		*hShow = NULL;
+		if (*hLocation)
+			UnhookWinEvent(*hLocation);
+		*hLocation = NULL;
+	}
 }
 
-static int global_ReplyMessage(lua_State *L) {
-    BOOL rc;
-    LRESULT result = ( LRESULT) luaL_checknumber( L, 1);
+static void WinEventThread(void *v) {
+	HANDLE ready = (HANDLE)v;
+	HWINEVENTHOOK hCreate, hName, hShow = NULL, hLocation = NULL;
+	HMODULE hmod;
+	MSG msg;
+
+	// the hooks call back into this dll, keep it loaded while the thread lives
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+	                  (LPCSTR)WinEventProc, &hmod);
+
+	// the message queue must exist before WE_SYNCLAYOUT can be posted
+	PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
+	winEvents.tid = GetCurrentThreadId();
+
+	hCreate = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_DESTROY,
+	                          NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+	hName = SetWinEventHook(EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE,
+	                        NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+	winEvents.running = hCreate != NULL && hName != NULL;
+	SetEvent(ready);
+
+	if (winEvents.running)
+		while (GetMessage(&msg, NULL, 0, 0) > 0) {
+			if (msg.hwnd == NULL && msg.message == WE_SYNCLAYOUT)
+				SyncLayoutHooks(&hShow, &hLocation);
+			else
+				DispatchMessage(&msg);
+		}
+
+	if (hCreate)
+		UnhookWinEvent(hCreate);
+	if (hName)
+		UnhookWinEvent(hName);
+	if (hShow)
+		UnhookWinEvent(hShow);
+	if (hLocation)
+		UnhookWinEvent(hLocation);
+}
 
-    rc = ReplyMessage( result);
+static BOOL CALLBACK StartWinEventThreadOnce(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+	HANDLE ready = CreateEvent(NULL, TRUE, FALSE, NULL);
 
-    lua_pushboolean( L, rc);
+	if (ready == NULL)
+		return TRUE;
+	if (_beginthread(WinEventThread, 0, ready) != (uintptr_t)-1L)
+		WaitForSingleObject(ready, INFINITE);
+	CloseHandle(ready);
 
-    return( 1);
+	return TRUE;
 }
 
-static int global_DispatchMessage(lua_State *L) {
-    MSG msg;
-    LRESULT rc;
-    long hwnd = MYP2HCAST luaL_checknumber( L, 1);
+// returns FALSE when window events are not available
+static BOOL StartWinEventThread(void) {
+	InitOnceExecuteOnce(&winEventsOnce, StartWinEventThreadOnce, NULL, NULL);
+	return winEvents.running;
+}
 
-    msg.hwnd = ( HWND) hwnd;
-    msg.message = ( UINT) luaL_checknumber( L, 2);
-    msg.wParam = ( WPARAM) luaL_checknumber( L, 3);
-    msg.lParam = ( LPARAM) luaL_checknumber( L, 4);
-    msg.time = ( DWORD) luaL_checknumber( L, 5);
-    msg.pt.x = ( LONG) luaL_checknumber( L, 6);
-    msg.pt.y = ( LONG) luaL_checknumber( L, 7);
+// a tracker is created (delta 1) or closed (delta -1)
+static void CountWindowTracker(LONG delta) {
+	const LONG n = InterlockedExchangeAdd(&winEvents.trackers, delta) + delta;
 
-    rc = DispatchMessage( &msg);
+	if (winEvents.running && (n == 0 || (n == 1 && delta > 0)))
+		PostThreadMessage(winEvents.tid, WE_SYNCLAYOUT, 0, 0);
+}
 
-    lua_pushnumber( L, rc);
+// waits until the window tree generation differs from generation;
+// returns FALSE on timeout
+static BOOL WaitWinEvent(LONG generation, DWORD timeout) {
+	BOOL changed = TRUE;
+
+	AcquireSRWLockShared(&winEventsLock);
+	while (winEvents.generation == generation) {
+		if (!SleepConditionVariableSRW(&winEventsCond, &winEventsLock, timeout,
+		                               CONDITION_VARIABLE_LOCKMODE_SHARED)) {
+			changed = winEvents.generation != generation;
+			break;
+		}
+	}
+	ReleaseSRWLockShared(&winEventsLock);
 
-    return( 1);
+	return changed;
 }
 
-static int global_SetTopmost(lua_State *L) {
-    BOOL rc;
-    long hwnd = MYP2HCAST luaL_checknumber( L, 1);
+/* Window handle cache invalidated by window events */
 
-    rc = SetWindowPos( ( HWND) hwnd, HWND_TOPMOST, 0, 0, 0, 0,
-                        SWP_NOMOVE | SWP_NOSIZE);
+#define WNDCACHE_SIZE   256     // power of 2
 
-    lua_pushnumber( L, rc);
+struct S_WNDCACHEENTRY {
+	HWND parent;
+	char *key;          // code page, class '\0' title
+	size_t keylen;
+	HWND hwnd;
+	LONG generation;
+};
 
-    return( 1);
-}
+static struct {
+	struct S_WNDCACHEENTRY entries[WNDCACHE_SIZE];
+	volatile LONG hits;
+	volatile LONG misses;
+} wndCache;
 
-/****if* luaw32/global_GetLastError
-* NAME
-*  global_GetLastError
-* FUNCTION
-*  Win32 GetLastError.
-* RESULT
-*  stack[1]: The calling thread's last-error code value
-* SOURCE
-*/
+static SRWLOCK wndCacheLock = SRWLOCK_INIT;
 
-static int global_GetLastError(lua_State *L) {
+#define FNV_OFFSET      2166136261u
 
-    lua_pushnumber( L, GetLastError());
+// FNV-1a, start with h = FNV_OFFSET
+static unsigned int HashBytes(unsigned int h, const void *p, size_t len) {
+	const unsigned char *b = (const unsigned char *)p;
+	size_t i;
 
-    return( 1);
+	for (i = 0; i < len; i++)
+		h = (h ^ b[i]) * 16777619u;
+
+	return h;
 }
-/***/
 
-/****if* luaw32/global_CloseHandle
-* NAME
-*  global_CloseHandle
-* FUNCTION
-*  Win32 CloseHandle.
-* INPUTS
-*  L: Lua state
-*  stack[1]: Handle to an open object
-* RESULT
-*  stack[1]: True if ok.
-* SOURCE
-*/
+static unsigned int HashWindowKey(HWND parent, const char *key, size_t keylen) {
+	return HashBytes(HashBytes(FNV_OFFSET, &parent, sizeof(parent)), key, keylen);
+}
 
-static int global_CloseHandle(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+// Lua:  FindWindowCached(parent, class, title)
+//       same result as FindWindowEx(parent, 0, class, title), repeated lookups
+//       are served from the cache until a window is created, destroyed or renamed
+static int global_FindWindowCached(lua_State *L) {
+	const HWND parent = (HWND)(INT_PTR)luaL_optinteger(L, 1, 0);
+	size_t clen, wlen;
+	const char *cname = luaL_optlstring(L, 2, "", &clen);
+	const char *wname = luaL_optlstring(L, 3, "", &wlen);
+	const UINT cp = GetTextCodePage(L);
+	struct S_WNDCACHEENTRY *e;
+	char key[512];
+	// the same bytes name other windows in another encoding
+	size_t keylen = sizeof(cp) + clen + 1 + wlen;
+	LONG generation;
+	HWND hwnd;
+
+	if (!StartWinEventThread() || keylen > sizeof(key)) {
+		InterlockedIncrement(&wndCache.misses);
+		lua_pushhwnd(L, FindWindowWide(cp, parent, NULL, cname, wname));
+		return 1;
+	}
 
-    lua_pushboolean( L, CloseHandle( ( HANDLE) h));
+	memcpy(key, &cp, sizeof(cp));
+	memcpy(key + sizeof(cp), cname, clen + 1);
+	memcpy(key + sizeof(cp) + clen + 1, wname, wlen);
+	e = &wndCache.entries[HashWindowKey(parent, key, keylen) & (WNDCACHE_SIZE - 1)];
+
+	AcquireSRWLockShared(&wndCacheLock);
+	generation = winEvents.generation;
+	if (e->key != NULL && e->generation == generation && e->parent == parent &&
+	    e->keylen == keylen && memcmp(e->key, key, keylen) == 0 &&
+	    (e->hwnd == NULL || IsWindow(e->hwnd))) {
+		hwnd = e->hwnd;
+		ReleaseSRWLockShared(&wndCacheLock);
+		InterlockedIncrement(&wndCache.hits);
+		lua_pushhwnd(L, hwnd);
+		return 1;
+	}
+	ReleaseSRWLockShared(&wndCacheLock);
+
+	// generation is taken before the search so a concurrent change leaves the entry stale
+	InterlockedIncrement(&wndCache.misses);
+	hwnd = FindWindowWide(cp, parent, NULL, cname, wname);
+
+	AcquireSRWLockExclusive(&wndCacheLock);
+	if (e->key == NULL || e->keylen != keylen) {
+		char *k = realloc(e->key, keylen);
+		if (k != NULL) {
+			e->key = k;
+			e->keylen = keylen;
+		}
+	}
+	if (e->key != NULL && e->keylen == keylen) {
+		memcpy(e->key, key, keylen);
+		e->parent = parent;
+		e->hwnd = hwnd;
+		e->generation = generation;
+	}
+	ReleaseSRWLockExclusive(&wndCacheLock);
 
-    return( 1);
+	lua_pushhwnd(L, hwnd);
+
+	return 1;
 }
-/***/
 
-static int global_CreateEvent(lua_State *L) {
-    SECURITY_ATTRIBUTES sa;
-    BOOL mr = ( BOOL) luaL_checknumber( L, 2);
-    BOOL is = ( BOOL) luaL_checknumber( L, 3);
-    const char *name;
-    long h;
+// Lua:  returns hits, misses, generation (number of window tree changes seen)
+static int global_GetWindowCacheStats(lua_State *L) {
+	lua_pushinteger(L, wndCache.hits);
+	lua_pushinteger(L, wndCache.misses);
+	lua_pushinteger(L, winEvents.generation);
+	return 3;
+}
 
-    sa.nLength = sizeof( sa);
-    sa.lpSecurityDescriptor = NULL;
-    sa.bInheritHandle = FALSE;
+static int global_FlushWindowCache(lua_State *L) {
+	InterlockedIncrement(&winEvents.generation);
+	if (lua_toboolean(L, 1)) {
+		InterlockedExchange(&wndCache.hits, 0);
+		InterlockedExchange(&wndCache.misses, 0);
+	}
+	return 0;
+}
 
-    if( lua_istable( L, 1)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 1);
-        if( !lua_isnil( L, -1))
-            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 1);
-    }
-    name = lua_tostring( L, 4);
+#define WAITWND_POLL    50      // ms, used when window events are not available
+
+// Lua:  WaitForWindow(class, title, timeoutMs)
+//       returns hwnd as soon as a matching top-level window exists, 0 on timeout
+static int global_WaitForWindow(lua_State *L) {
+	const UINT cp = GetTextCodePage(L);
+	const WCHAR *cname = PushWideName(L, cp, luaL_checkstring(L, 1));
+	const WCHAR *wname = PushWideName(L, cp, luaL_optstring(L, 2, NULL));
+	const DWORD timeout = (DWORD)luaL_checkinteger(L, 3);
+	const BOOL events = StartWinEventThread();
+	const DWORD start = GetTickCount();
+	HWND hwnd;
+
+	for (;;) {
+		// generation is taken before the search, so a window created
+		// right after FindWindow still wakes the wait below
+		const LONG generation = winEvents.generation;
+		DWORD left = INFINITE;
+
+		hwnd = FindWindowW(cname, wname);
+		if (hwnd != NULL)
+			break;
+
+		if (timeout != INFINITE) {
+			const DWORD elapsed = GetTickCount() - start;
+			if (elapsed >= timeout)
+				break;
+			left = timeout - elapsed;
+		}
 
-    h = ( long) CreateEvent( &sa, mr, is, name);
+		if (events)
+			WaitWinEvent(generation, left);
+		else
+			Sleep(left < WAITWND_POLL ? left : WAITWND_POLL);
+	}
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+	lua_pushhwnd(L, hwnd);
 
-    return( 1);
+	return 1;
 }
 
-static int global_OpenEvent(lua_State *L) {
-    long h;
-    DWORD da = ( DWORD) luaL_checknumber( L, 1);
-    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
-    const char *name = luaL_checkstring( L, 3);
+/* Compiled window selectors
+*
+*  selector := step { ('>' | ' ') step }
+*  step     := (class | '*') { '[' attr '=' value ']' | ':' pseudo }
+*  attr     := pid (number or "self") | title (wildcards * and ?) | class
+*  pseudo   := visible | nth(n) | nth-child(n)
+*
+*  '>' selects direct children, whitespace selects any descendants.
+*  The first step matches direct children of the root (top-level windows by default).
+*  nth(n) is the n-th sibling matching the step, nth-child(n) is the n-th sibling at all.
+*/
 
-    h = ( long) OpenEvent( da, ih, name);
+#define SELECTOR_MT     "w32.Selector"
+#define SEL_MAXSTEPS    16
+#define SEL_MAXNAME     256
+
+#define SEL_CHILD       0
+#define SEL_DESCENDANT  1
+
+struct S_SELSTEP {
+	int combinator;
+	WCHAR cname[SEL_MAXNAME];   // "" - any class
+	WCHAR title[SEL_MAXNAME];   // wildcard pattern
+	BOOL hasTitle;
+	DWORD pid;                  // 0 - any process
+	BOOL visible;
+	int nth;                    // 0 - any
+	int nthChild;               // 0 - any
+};
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+struct S_SELECTOR {
+	int nsteps;
+	struct S_SELSTEP steps[SEL_MAXSTEPS];
+};
 
-    return( 1);
+static void CopySelectorName(lua_State *L, char *out, const char *s, size_t len) {
+	if (len >= SEL_MAXNAME)
+		luaL_error(L, "selector: name too long near '%s'", s);
+	memcpy(out, s, len);
+	out[len] = '\0';
 }
 
-static int global_PulseEvent(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+// names are matched by the W API, s is in the script encoding
+static void WidenSelectorName(UINT cp, WCHAR *out, const char *s) {
+	const int n = MultiByteToWideChar(cp, 0, s, -1, out, SEL_MAXNAME);
+	if (n <= 0)
+		out[0] = 0;
+}
 
-    lua_pushnumber( L, PulseEvent( ( HANDLE) h));
+static const char *ParseSelectorAttr(lua_State *L, UINT cp, const char *s, struct S_SELSTEP *st) {
+	char name[16];
+	char value[SEL_MAXNAME];
+	size_t len = strcspn(s, "=]");
+
+	if (s[len] != '=' || len >= sizeof(name))
+		luaL_error(L, "selector: bad attribute near '%s'", s);
+	memcpy(name, s, len);
+	name[len] = '\0';
+	s += len + 1;
+
+	if (*s == '"' || *s == '\'') {
+		const char *e = strchr(s + 1, *s);
+		if (e == NULL || e[1] != ']')
+			luaL_error(L, "selector: unfinished string near '%s'", s);
+		CopySelectorName(L, value, s + 1, e - s - 1);
+		s = e + 2;
+	}
+	else {
+		len = strcspn(s, "]");
+		if (s[len] != ']')
+			luaL_error(L, "selector: ']' expected near '%s'", s);
+		CopySelectorName(L, value, s, len);
+		s += len + 1;
+	}
 
-    return( 1);
+	if (strcmp(name, "pid") == 0) {
+		char *e;
+		if (strcmp(value, "self") == 0)
+			st->pid = GetCurrentProcessId();
+		else if ((st->pid = strtoul(value, &e, 10)) == 0 || *e != '\0')
+			luaL_error(L, "selector: bad pid '%s'", value);
+	}
+	else if (strcmp(name, "title") == 0 || strcmp(name, "text") == 0) {
+		WidenSelectorName(cp, st->title, value);
+		st->hasTitle = TRUE;
+	}
+	else if (strcmp(name, "class") == 0)
+		WidenSelectorName(cp, st->cname, value);
+	else
+		luaL_error(L, "selector: unknown attribute '%s'", name);
+
+	return s;
 }
 
-static int global_ResetEvent(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+static const char *ParseSelectorPseudo(lua_State *L, const char *s, struct S_SELSTEP *st) {
+	const size_t len = strcspn(s, " \t>[:(");
 
-    lua_pushnumber( L, ResetEvent( ( HANDLE) h));
+	if (len == 7 && strncmp(s, "visible", len) == 0) {
+		st->visible = TRUE;
+		return s + len;
+	}
+	if ((len == 3 && strncmp(s, "nth", len) == 0) ||
+	    (len == 9 && strncmp(s, "nth-child", len) == 0)) {
+		char *e;
+		const long n = s[len] == '(' ? strtol(s + len + 1, &e, 10) : 0;
+		if (n < 1 || *e != ')')
+			luaL_error(L, "selector: bad index near '%s'", s);
+		if (len == 3)
+			st->nth = (int)n;
+		else
+			st->nthChild = (int)n;
+		return e + 1;
+	}
 
-    return( 1);
+	luaL_error(L, "selector: unknown pseudo-class near '%s'", s);
+	return s;
 }
 
-static int global_SetEvent(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+static void CompileSelector(lua_State *L, UINT cp, const char *s, struct S_SELECTOR *sel) {
+	static const char blank[] = " \t";
+	int combinator = SEL_CHILD;
+
+	memset(sel, 0, sizeof(*sel));
+
+	s += strspn(s, blank);
+	while (*s) {
+		const char *start = s;
+		struct S_SELSTEP *st;
+		size_t len;
+
+		if (sel->nsteps == SEL_MAXSTEPS)
+			luaL_error(L, "selector: too many steps");
+		st = &sel->steps[sel->nsteps++];
+		st->combinator = combinator;
+
+		if (*s == '*')
+			s++;
+		else {
+			char name[SEL_MAXNAME];
+			len = strcspn(s, " \t>[:");
+			CopySelectorName(L, name, s, len);
+			WidenSelectorName(cp, st->cname, name);
+			s += len;
+		}
+		for (;;) {
+			if (*s == '[')
+				s = ParseSelectorAttr(L, cp, s + 1, st);
+			else if (*s == ':')
+				s = ParseSelectorPseudo(L, s + 1, st);
+			else
+				break;
+		}
+		if (s == start)
+			luaL_error(L, "selector: unexpected '%s'", s);
+
+		len = strspn(s, blank);
+		if (s[len] == '>') {
+			combinator = SEL_CHILD;
+			s += len + 1;
+			s += strspn(s, blank);
+			if (*s == '\0')
+				luaL_error(L, "selector: step expected after '>'");
+		}
+		else if (len > 0) {
+			combinator = SEL_DESCENDANT;
+			s += len;
+		}
+		else if (*s != '\0')
+			luaL_error(L, "selector: unexpected '%s'", s);
+	}
 
-    lua_pushnumber( L, SetEvent( ( HANDLE) h));
+	if (sel->nsteps == 0)
+		luaL_error(L, "selector: empty selector");
+}
 
-    return( 1);
+// '*' - any sequence, '?' - any single character
+static BOOL WildcardMatch(const WCHAR *pat, const WCHAR *s) {
+	const WCHAR *star = NULL;
+	const WCHAR *back = s;
+
+	while (*s) {
+		if (*pat == '?' || (*pat == *s && *pat != '*')) {
+			pat++;
+			s++;
+		}
+		else if (*pat == '*') {
+			star = pat++;
+			back = s;
+		}
+		else if (star) {
+			pat = star + 1;
+			s = ++back;
+		}
+		else
+			return FALSE;
+	}
+	while (*pat == '*')
+		pat++;
+
+	return *pat == 0;
 }
 
-static int global_CreateMutex(lua_State *L) {
-    SECURITY_ATTRIBUTES sa;
-    BOOL io = ( BOOL) luaL_checknumber( L, 2);
-    const char *name;
-    long h;
+static BOOL MatchSelectorStep(HWND hwnd, const struct S_SELSTEP *st) {
+	WCHAR buf[2048];
 
-    sa.nLength = sizeof( sa);
-    sa.lpSecurityDescriptor = NULL;
-    sa.bInheritHandle = FALSE;
+	if (st->visible && !IsWindowVisible(hwnd))
+		return FALSE;
+	if (st->pid) {
+		DWORD pid = 0;
+		GetWindowThreadProcessId(hwnd, &pid);
+		if (pid != st->pid)
+			return FALSE;
+	}
+	if (st->cname[0]) {
+		if (!GetClassNameW(hwnd, buf, sizeof(buf) / sizeof(buf[0])) || lstrcmpiW(buf, st->cname) != 0)
+			return FALSE;
+	}
+	if (st->hasTitle) {
+		if (GetWindowTextW(hwnd, buf, sizeof(buf) / sizeof(buf[0])) <= 0)
+			buf[0] = 0;
+		if (!WildcardMatch(st->title, buf))
+			return FALSE;
+	}
 
-    if( lua_istable( L, 1)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 1);
-        if( !lua_isnil( L, -1))
-            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 1);
-    }
-    name = lua_tostring( L, 3);
+	return TRUE;
+}
 
-    h = ( long) CreateMutex( &sa, io, name);
+struct S_SELRUN {
+	const struct S_SELECTOR *sel;
+	BOOL first;
+	struct S_HWNDLIST found;
+	HWND *seen;                 // open-addressed set of found windows, at most half full
+	int seenMask;               // capacity - 1, -1 - no set yet
+};
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+// returns FALSE when hwnd is already in the set
+static BOOL InsertSeenWindow(HWND *set, int mask, HWND hwnd) {
+	unsigned int i = HashBytes(FNV_OFFSET, &hwnd, sizeof(hwnd)) & mask;
 
-    return( 1);
+	for (; set[i] != NULL; i = (i + 1) & mask)
+		if (set[i] == hwnd)
+			return FALSE;
+	set[i] = hwnd;
+
+	return TRUE;
 }
 
-static int global_OpenMutex(lua_State *L) {
-    long h;
-    DWORD da = ( DWORD) luaL_checknumber( L, 1);
-    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
-    const char *name = luaL_checkstring( L, 3);
+// returns FALSE when the walk must stop; a descendant step reaches a window once
+// per matching ancestor, the set drops the repeats
+static BOOL AddSelectorResult(struct S_SELRUN *run, HWND hwnd) {
+	int i;
 
-    h = ( long) OpenMutex( da, ih, name);
+	if ((run->found.count + 1) * 2 > run->seenMask + 1) {
+		const int capacity = run->seenMask >= 0 ? (run->seenMask + 1) * 2 : 64;
+		HWND *seen = calloc(capacity, sizeof(HWND));
+		if (seen == NULL)
+			return FALSE;
+		for (i = 0; i < run->found.count; i++)
+			InsertSeenWindow(seen, capacity - 1, run->found.items[i]);
+		free(run->seen);
+		run->seen = seen;
+		run->seenMask = capacity - 1;
+	}
+	if (!InsertSeenWindow(run->seen, run->seenMask, hwnd))
+		return TRUE;
+	if (!CollectWindowProc(hwnd, (LPARAM)&run->found))
+		return FALSE;
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+	return !run->first;
+}
 
-    return( 1);
+// matches step i against children (or descendants) of parent, NULL parent - top-level windows
+static BOOL RunSelectorStep(struct S_SELRUN *run, int i, HWND parent) {
+	const struct S_SELSTEP *st = &run->sel->steps[i];
+	const BOOL last = i + 1 == run->sel->nsteps;
+	int pos = 0;
+	int matched = 0;
+	HWND child;
+
+	for (child = FindWindowEx(parent, NULL, NULL, NULL); child != NULL;
+	     child = FindWindowEx(parent, child, NULL, NULL)) {
+		pos++;
+		if ((st->nthChild == 0 || st->nthChild == pos) && MatchSelectorStep(child, st)) {
+			matched++;
+			if (st->nth == 0 || st->nth == matched) {
+				if (last ? !AddSelectorResult(run, child) : !RunSelectorStep(run, i + 1, child))
+					return FALSE;
+			}
+		}
+		if (st->combinator == SEL_DESCENDANT) {
+			if (!RunSelectorStep(run, i, child))
+				return FALSE;
+		}
+		else if ((st->nthChild && pos >= st->nthChild) || (st->nth && matched >= st->nth))
+			break;
+	}
+
+	return TRUE;
 }
 
-static int global_ReleaseMutex(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+static void RunSelector(lua_State *L, BOOL first, struct S_SELRUN *run) {
+	const HWND root = (HWND)(INT_PTR)luaL_optinteger(L, 2, 0);
 
-    lua_pushnumber( L, ReleaseMutex( ( HANDLE) h));
+	run->sel = (const struct S_SELECTOR *)luaL_checkudata(L, 1, SELECTOR_MT);
+	run->first = first;
+	memset(&run->found, 0, sizeof(run->found));
+	run->seen = NULL;
+	run->seenMask = -1;
 
-    return( 1);
+	RunSelectorStep(run, 0, root);
+	free(run->seen);
 }
 
-static int global_CreateSemaphore(lua_State *L) {
-    SECURITY_ATTRIBUTES sa;
-    long ic = ( long) luaL_checknumber( L, 2);
-    long mc = ( long) luaL_checknumber( L, 3);
-    const char *name;
-    long h;
+// Lua:  sel = CompileSelector("InfoClass[pid=self] > SysTabControl32:visible")
+static int global_CompileSelector(lua_State *L) {
+	const char *src = luaL_checkstring(L, 1);
+	struct S_SELECTOR *sel = (struct S_SELECTOR *)lua_newuserdata(L, sizeof(struct S_SELECTOR));
 
-    sa.nLength = sizeof( sa);
-    sa.lpSecurityDescriptor = NULL;
-    sa.bInheritHandle = FALSE;
+	CompileSelector(L, GetTextCodePage(L), src, sel);
+	luaL_getmetatable(L, SELECTOR_MT);
+	lua_setmetatable(L, -2);
 
-    if( lua_istable( L, 1)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 1);
-        if( !lua_isnil( L, -1))
-            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 1);
-    }
-    name = lua_tostring( L, 4);
+	return 1;
+}
 
-    h = ( long) CreateSemaphore( &sa, ic, mc, name);
+// Lua:  sel:find(root) returns first matching hwnd or 0
+static int selector_find(lua_State *L) {
+	struct S_SELRUN run;
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+	RunSelector(L, TRUE, &run);
+	lua_pushhwnd(L, run.found.count > 0 ? run.found.items[0] : NULL);
+	FreeWindowList(&run.found);
 
-    return( 1);
+	return 1;
 }
 
-static int global_OpenSemaphore(lua_State *L) {
-    long h;
-    DWORD da = ( DWORD) luaL_checknumber( L, 1);
-    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
-    const char *name = luaL_checkstring( L, 3);
+// Lua:  sel:findAll(root) returns array of matching hwnds
+static int selector_findAll(lua_State *L) {
+	struct S_SELRUN run;
+	int i;
 
-    h = ( long) OpenSemaphore( da, ih, name);
+	RunSelector(L, FALSE, &run);
+	lua_createtable(L, run.found.count, 0);
+	for (i = 0; i < run.found.count; i++) {
+		lua_pushhwnd(L, run.found.items[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	FreeWindowList(&run.found);
 
-    if( h)
-        lua_pushnumber( L, h);
-    else
-        lua_pushnil( L);
+	return 1;
+}
 
-    return( 1);
+static int selector_tostring(lua_State *L) {
+	lua_pushfstring(L, SELECTOR_MT ": %p", luaL_checkudata(L, 1, SELECTOR_MT));
+	return 1;
 }
 
-static int global_ReleaseSemaphore(lua_State *L) {
-    long pc;
-    BOOL brc;
-    long h = MYP2HCAST luaL_checknumber( L, 1);
-    long rc = ( long) luaL_checknumber( L, 2);
+static const luaL_Reg selector_methods[] = {
+	{"find", selector_find},
+	{"findAll", selector_findAll},
+	{"__tostring", selector_tostring},
+	{NULL, NULL}
+};
 
-    brc = ReleaseSemaphore( ( HANDLE) h, rc, &pc);
-    lua_pushnumber( L, brc);
-    if( brc)
-        lua_pushnumber( L, pc);
-    else
-        lua_pushnil( L);
+/* Window tracker: keeps the previous window list natively and reports differences */
 
-    return( 2);
-}
+#define TRACKER_MT      "w32.WindowTracker"
 
-static int global_CreateProcess(lua_State *L) {
-    SECURITY_ATTRIBUTES psa;
-    SECURITY_ATTRIBUTES tsa;
-    PROCESS_INFORMATION pi;
-    STARTUPINFO si;
-    BOOL brc;
-    char *env;
-    const char *an = luaL_optstring( L, 1, NULL);
-    const char *cl = luaL_optstring( L, 2, NULL);
-    BOOL ih = ( BOOL) luaL_checknumber( L, 5);
-    DWORD cf = ( DWORD) luaL_checknumber( L, 6);
-    const char *cd = lua_tostring( L, 8);
+struct S_WNDSTATE {
+	HWND hwnd;
+	unsigned int titleHash;
+	BOOL visible;
+	RECT rect;
+};
 
-    psa.nLength = sizeof( psa);
-    psa.lpSecurityDescriptor = NULL;
-    psa.bInheritHandle = FALSE;
-    if( lua_istable( L, 3)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 3);
-        if( !lua_isnil( L, -1))
-            psa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 3);
-    }
+struct S_TRACKER {
+	HWND parent;                // NULL - top-level windows
+	struct S_WNDSTATE *items;   // sorted by hwnd
+	int count;
+	LONG generation;
+	LONG layoutGeneration;
+	BOOL open;                  // counted in winEvents.trackers
+};
 
-    tsa.nLength = sizeof( tsa);
-    tsa.lpSecurityDescriptor = NULL;
-    tsa.bInheritHandle = FALSE;
-    if( lua_istable( L, 4)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 4);
-        if( !lua_isnil( L, -1))
-            tsa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 4);
-    }
+static struct S_TRACKER *CheckTracker(lua_State *L) {
+	struct S_TRACKER *t = (struct S_TRACKER *)luaL_checkudata(L, 1, TRACKER_MT);
+	if (!t->open)
+		luaL_error(L, "window tracker is closed");
+	return t;
+}
 
-    env = NULL;
+static int CompareWindowState(const void *a, const void *b) {
+	const UINT_PTR ha = (UINT_PTR)((const struct S_WNDSTATE *)a)->hwnd;
+	const UINT_PTR hb = (UINT_PTR)((const struct S_WNDSTATE *)b)->hwnd;
+	return ha < hb ? -1 : ha > hb;
+}
 
-    memset( &si, 0, sizeof( si));
-    si.cb = sizeof( si);
-    if( lua_istable(L, 7)) {
-        lua_pushnil(L);
-        while( lua_next(L, 7) != 0) {
-            const char *key = luaL_checkstring( L, -2);
-            if( !strcmp( key, "lpDesktop")) {
-                si.lpDesktop = _strdup( luaL_checkstring( L, -1));
-            } else if( !strcmp( key, "lpTitle")) {
-                si.lpTitle = _strdup( luaL_checkstring( L, -1));
-            } else if( !strcmp( key, "dwX")) {
-                si.dwX = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwY")) {
-                si.dwY = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwXSize")) {
-                si.dwXSize = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwYSize")) {
-                si.dwYSize = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwXCountChars")) {
-                si.dwXCountChars = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwYCountChars")) {
-                si.dwYCountChars = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwFillAttribute")) {
-                si.dwFillAttribute = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "dwFlags")) {
-                si.dwFlags = ( DWORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "wShowWindow")) {
-                si.wShowWindow = ( WORD) luaL_checknumber( L, -1);
-            } else if( !strcmp( key, "hStdInput")) {
-                long h = ( long) luaL_checknumber( L, -1);
-                si.hStdInput = ( HANDLE) h;
-            } else if( !strcmp( key, "hStdOutput")) {
-                long h = ( long) luaL_checknumber( L, -1);
-                si.hStdOutput = ( HANDLE) h;
-            } else if( !strcmp( key, "hStdError")) {
-                long h = ( long) luaL_checknumber( L, -1);
-                si.hStdError = ( HANDLE) h;
-            }
-            lua_pop(L, 1);
+// UTF-16 text, so a rename is seen whatever the script encoding
+static unsigned int HashWindowTitle(HWND hwnd) {
+	WCHAR buf[2048];
+	const int len = GetWindowTextW(hwnd, buf, sizeof(buf) / sizeof(buf[0]));
+	return HashBytes(FNV_OFFSET, buf, (len > 0 ? len : 0) * sizeof(WCHAR));
+}
+
+// fills hwnd, visibility and rect sorted by hwnd; titles are filled by the caller
+static BOOL TakeWindowStates(HWND parent, struct S_WNDSTATE **items, int *count) {
+	struct S_HWNDLIST list;
+	int i;
+
+	CollectWindows(parent, &list);
+	*items = malloc((list.count ? list.count : 1) * sizeof(struct S_WNDSTATE));
+	*count = list.count;
+	if (*items == NULL) {
+		FreeWindowList(&list);
+		return FALSE;
+	}
+
+	for (i = 0; i < list.count; i++) {
+		struct S_WNDSTATE *w = &(*items)[i];
+		w->hwnd = list.items[i];
+		w->titleHash = 0;
+		w->visible = IsWindowVisible(w->hwnd);
+		if (!GetWindowRect(w->hwnd, &w->rect))
+			memset(&w->rect, 0, sizeof(w->rect));
+	}
+	FreeWindowList(&list);
+
+	qsort(*items, *count, sizeof(struct S_WNDSTATE), CompareWindowState);
+
+	return TRUE;
+}
+
+static void AppendHwnd(lua_State *L, int t, int *n, HWND hwnd) {
+	lua_pushhwnd(L, hwnd);
+	lua_rawseti(L, t, ++*n);
+}
+
+// Lua:  tracker = CreateWindowTracker(parent), parent 0 or nil - top-level windows
+static int global_CreateWindowTracker(lua_State *L) {
+	const HWND parent = (HWND)(INT_PTR)luaL_optinteger(L, 1, 0);
+	struct S_TRACKER *t = (struct S_TRACKER *)lua_newuserdata(L, sizeof(struct S_TRACKER));
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	luaL_getmetatable(L, TRACKER_MT);
+	lua_setmetatable(L, -2);
+
+	t->parent = parent;
+	StartWinEventThread();
+	t->open = TRUE;
+	CountWindowTracker(1);
+	t->generation = winEvents.generation;
+	t->layoutGeneration = winEvents.layoutGeneration;
+	if (!TakeWindowStates(parent, &t->items, &t->count))
+		return luaL_error(L, "not enough memory");
+	for (i = 0; i < t->count; i++)
+		t->items[i].titleHash = HashWindowTitle(t->items[i].hwnd);
+
+	return 1;
+}
+
+// Lua:  tracker:diff() returns {added={}, removed={}, retitled={}, changed={}}
+//       arrays of hwnds changed since the previous call; "changed" means
+//       visibility or rect. Without window events since then nothing is enumerated.
+static int tracker_diff(lua_State *L) {
+	struct S_TRACKER *t = CheckTracker(L);
+	const BOOL events = StartWinEventThread();
+	const LONG generation = winEvents.generation;
+	const LONG layoutGeneration = winEvents.layoutGeneration;
+	// without tree events titles of known windows are still valid
+	const BOOL sameTitles = events && generation == t->generation;
+	struct S_WNDSTATE *cur;
+	int ncur, res, i, j;
+	int nadded = 0, nremoved = 0, nretitled = 0, nchanged = 0;
+
+	lua_createtable(L, 0, 4);
+	res = lua_gettop(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+
+	if (!sameTitles || !winEvents.layoutHooked || layoutGeneration != t->layoutGeneration) {
+		if (!TakeWindowStates(t->parent, &cur, &ncur))
+			return luaL_error(L, "not enough memory");
+
+		for (i = 0, j = 0; i < t->count || j < ncur;) {
+			const int cmp = i == t->count ? 1 : j == ncur ? -1 :
+			                CompareWindowState(&t->items[i], &cur[j]);
+			if (cmp < 0) {
+				AppendHwnd(L, res + 2, &nremoved, t->items[i].hwnd);
+				i++;
+			}
+			else if (cmp > 0) {
+				cur[j].titleHash = HashWindowTitle(cur[j].hwnd);
+				AppendHwnd(L, res + 1, &nadded, cur[j].hwnd);
+				j++;
+			}
+			else {
+				const struct S_WNDSTATE *old = &t->items[i];
+				cur[j].titleHash = sameTitles ? old->titleHash : HashWindowTitle(cur[j].hwnd);
+				if (cur[j].titleHash != old->titleHash)
+					AppendHwnd(L, res + 3, &nretitled, cur[j].hwnd);
+				if (cur[j].visible != old->visible || memcmp(&cur[j].rect, &old->rect, sizeof(RECT)) != 0)
+					AppendHwnd(L, res + 4, &nchanged, cur[j].hwnd);
+				i++;
+				j++;
+			}
+		}
+
+		free(t->items);
+		t->items = cur;
+		t->count = ncur;
+		t->generation = generation;
+		t->layoutGeneration = layoutGeneration;
+	}
+
+	lua_setfield(L, res, "changed");
+	lua_setfield(L, res, "retitled");
+	lua_setfield(L, res, "removed");
+	lua_setfield(L, res, "added");
+
+	return 1;
+}
+
+// Lua:  tracker:count() returns number of tracked windows
+static int tracker_count(lua_State *L) {
+	struct S_TRACKER *t = CheckTracker(L);
+	lua_pushinteger(L, t->count);
+	return 1;
+}
+
+// Lua:  tracker:close(), the last closed tracker stops layout events
+static int tracker_close(lua_State *L) {
+	struct S_TRACKER *t = (struct S_TRACKER *)luaL_checkudata(L, 1, TRACKER_MT);
+	free(t->items);
+	t->items = NULL;
+	t->count = 0;
+	if (t->open) {
+		t->open = FALSE;
+		CountWindowTracker(-1);
+	}
+	return 0;
+}
+
+static int tracker_tostring(lua_State *L) {
+	lua_pushfstring(L, TRACKER_MT ": %p", luaL_checkudata(L, 1, TRACKER_MT));
+	return 1;
+}
+
+static const luaL_Reg tracker_methods[] = {
+	{"diff", tracker_diff},
+	{"count", tracker_count},
+	{"close", tracker_close},
+	{"__gc", tracker_close},
+	{"__close", tracker_close},
+	{"__tostring", tracker_tostring},
+	{NULL, NULL}
+};
+
+static int global_SetWindowText(lua_State *L) {
+    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
+    size_t len;
+    const char *text = luaL_checklstring( L, 2, &len);
+    const UINT cp = GetScriptCodePage( L);
+    BOOL rc = FALSE;
+
+    if (cp) {
+        struct S_WSTR w;
+        if (ToWide( cp, text, len, &w)) {
+            rc = SetWindowTextW( hwnd, w.p);
+            FreeWide( &w);
         }
     }
+    else
+        rc = SetWindowText( hwnd, text);
 
+    lua_pushnumber( L, rc);
 
-    brc = CreateProcess( an, ( char *) cl, &psa, &tsa, ih, cf, env, cd, &si, &pi);
+    return( 1);
+}
 
-    if( si.lpDesktop != NULL)
-        free( si.lpDesktop);
-    if( si.lpTitle != NULL)
-        free( si.lpTitle);
+static int global_SetFocus(lua_State *L) {
+    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
+    HWND rc = SetFocus( hwnd);
+    lua_pushinteger( L, (int)rc);
 
-    lua_pushnumber( L, brc);
-    if( brc) {
-        lua_pushnumber( L, ( long) ( pi.hProcess));
-        lua_pushnumber( L, ( long) ( pi.hThread));
-        lua_pushnumber( L, pi.dwProcessId);
-        lua_pushnumber( L, pi.dwThreadId);
-    } else {
-        lua_pushnil( L);
-        lua_pushnil( L);
-        lua_pushnil( L);
+    return( 1);
+}
+
+static void PushWindowTextW(lua_State *L, UINT cp, HWND hwnd) {
+	WCHAR buf[1024];
+	int rc;
+
+	SetLastError(ERROR_SUCCESS);
+	rc = GetWindowTextW(hwnd, buf, sizeof(buf) / sizeof(buf[0]));
+
+	if (rc >= (int)(sizeof(buf) / sizeof(buf[0])) - 1) {
+		const int len = GetWindowTextLengthW(hwnd);
+		WCHAR *p = len > rc ? malloc((len + 1) * sizeof(WCHAR)) : NULL;
+		if (p != NULL) {
+			rc = GetWindowTextW(hwnd, p, len + 1);
+			PushWide(L, cp, p, rc > 0 ? rc : 0);
+			free(p);
+			return;
+		}
+	}
+
+	if (rc > 0)
+		PushWide(L, cp, buf, rc);
+	else if (GetLastError() == ERROR_SUCCESS)
+		lua_pushstring(L, "");
+	else
+		lua_pushnil(L);
+}
+
+// pushes window text of any length or nil when error occurred
+static void PushWindowText(lua_State *L, UINT cp, HWND hwnd) {
+	char buf[2048];
+	int rc;
+
+	if (cp) {
+		PushWindowTextW(L, cp, hwnd);
+		return;
+	}
+
+	SetLastError(ERROR_SUCCESS);
+	rc = GetWindowText(hwnd, buf, sizeof(buf));
+
+	if (rc >= (int)sizeof(buf) - 1) {
+		// the text may be truncated: read it again into a buffer of the real size
+		const int len = GetWindowTextLength(hwnd);
+		char *p = len > rc ? malloc(len + 1) : NULL;
+		if (p != NULL) {
+			rc = GetWindowText(hwnd, p, len + 1);
+			lua_pushlstring(L, p, rc > 0 ? rc : 0);
+			free(p);
+			return;
+		}
+	}
+
+	if (rc > 0)
+		lua_pushlstring(L, buf, rc);
+	else if (GetLastError() == ERROR_SUCCESS)
+		lua_pushstring(L, "");
+	else
+		lua_pushnil(L);
+}
+
+// Lua:  returns nil when error occurred
+static int global_GetWindowText(lua_State *L) {
+    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
+
+    PushWindowText( L, GetScriptCodePage( L), hwnd);
+
+    return( 1);
+}
+
+// Lua:  GetWindowTexts({hwnd1, hwnd2, ...})
+//       returns array of texts (nil for failed handles) and number of handles
+static int global_GetWindowTexts(lua_State *L) {
+	const UINT cp = GetScriptCodePage(L);
+	int n, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = (int)lua_rawlen(L, 1);
+
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		HWND hwnd;
+		lua_rawgeti(L, 1, i);
+		if (!lua_isnumber(L, -1))
+			return luaL_argerror(L, 1, "array of window handles expected");
+		hwnd = (HWND)(INT_PTR)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		PushWindowText(L, cp, hwnd);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushinteger(L, n);
+
+	return 2;
+}
+
+// Lua:  returns left,top,right,bottom when successfully
+//         or
+//       returns nil when error occurred
+static int global_GetWindowRect(lua_State *L) {
+    const HWND hwnd  = (HWND)(int)luaL_checknumber( L, 1);
+    RECT rect;
+
+    BOOL rc = GetWindowRect( hwnd, &rect);
+
+	if (!rc) {
         lua_pushnil( L);
+        return( 1);
+	}
+	else {
+        lua_pushinteger( L, rect.left);
+        lua_pushinteger( L, rect.top);
+        lua_pushinteger( L, rect.right);
+        lua_pushinteger( L, rect.bottom);
+	    return( 4);
     }
+}
 
-    return( 5);
+/* Hotkey service thread: one message-only window owns all hotkey registrations.
+   Every Lua state has its own id namespace and queue of pressed ids, drained by
+   PollHotKeys; when a target window is given, msg is still forwarded by PostMessage.
+   The system id of a registration is allocated by the service thread */
+
+#define HOTKEY_CLASS        "LuaW32HotKeyWindow"
+#define HOTKEY_KEY          "w32.hotkeys"           // registry: S_HKQUEUE of the state
+#define HOTKEY_MT           "w32.HotKeyQueue"
+#define HOTKEY_QUEUE_SIZE   256     // power of 2
+#define HOTKEY_MAXATOM      0xBFFF  // system ids of application hotkeys are 0..0xBFFF
+#define HK_REGISTER         (WM_APP + 1)
+#define HK_UNREGISTER       (WM_APP + 2)
+#define HK_UNREGISTERALL    (WM_APP + 3)
+
+// pressed ids of one Lua state; the service thread is the only producer,
+// pollers of the state's threads claim entries by moving head with CAS
+struct S_HKQUEUE {
+	volatile LONG head, tail;
+	volatile LONG lost;
+	volatile LONG ids[HOTKEY_QUEUE_SIZE];
+};
+
+struct S_HKT {
+    struct S_HKQUEUE *queue;
+    int id;
+    int atom;
+    HWND hwnd;
+    UINT mdfs;
+    UINT vk;
+    UINT umsg;
+    WPARAM wparam;
+    LPARAM lparam;
+};
+
+static struct {
+	HWND hwnd;
+	// registrations, touched by the service thread only
+	struct S_HKT *keys;
+	int count, capacity;
+	int lastAtom;
+} hotKeys;
+
+static INIT_ONCE hotKeysOnce = INIT_ONCE_STATIC_INIT;
+
+static int FindHotKey(const struct S_HKQUEUE *queue, int id) {
+	int i;
+
+	for (i = 0; i < hotKeys.count; i++)
+		if (hotKeys.keys[i].queue == queue && hotKeys.keys[i].id == id)
+			return i;
+
+	return -1;
 }
 
-/****if* luaw32/global_GetTempFileName
-* NAME
-*  global_GetTempFileName
-* FUNCTION
-*  Win32 GetTempFileName.
-* INPUTS
-*  L: Lua state
-*  stack[1]: specifies the directory path for the file name
-*  stack[2]: Specifies the type of access to the object
-*  stack[3]: Specifies an unsigned integer that the function
-*            converts to a hexadecimal string for use in creating
-*            the temporary file name
-* RESULT
-*  stack[1]: Unique numeric value or 0 if error
-*  stack[2]: Temporary file name or nil if error
-* SOURCE
-*/
+static int FindHotKeyAtom(int atom) {
+	int i;
 
-static int global_GetTempFileName(lua_State *L) {
-    UINT rc;
-    char tfn[MAX_PATH*4];
-    const char *path = luaL_checkstring( L, 1);
-    const char *pfx = luaL_checkstring( L, 2);
-    UINT unique = ( UINT) luaL_checknumber( L, 3);
+	for (i = 0; i < hotKeys.count; i++)
+		if (hotKeys.keys[i].atom == atom)
+			return i;
 
-    rc = GetTempFileName( path, pfx, unique, tfn);
+	return -1;
+}
 
-    lua_pushnumber( L, rc);
-    if( rc)
-        lua_pushstring( L, tfn);
-    else
-        lua_pushnil( L);
+static void RemoveHotKeyAt(int i) {
+	UnregisterHotKey(hotKeys.hwnd, hotKeys.keys[i].atom);
+	hotKeys.keys[i] = hotKeys.keys[--hotKeys.count];
+}
 
-    return( 2);
+static BOOL UnregisterHotKeyEntry(const struct S_HKQUEUE *queue, int id) {
+	const int i = FindHotKey(queue, id);
+
+	if (i < 0)
+		return FALSE;
+	RemoveHotKeyAt(i);
+
+	return TRUE;
 }
-/***/
 
-/****if* luaw32/global_GetTempPath
-* NAME
-*  global_GetTempPath
-* FUNCTION
-*  Win32 GetTempPath.
-* INPUTS
-*  L: Lua state
-* RESULT
-*  stack[1]: Unique numeric value or 0 if error
-*  stack[2]: Path of the directory designated for temporary files
-* SOURCE
-*/
+// the queue is released after this returns, so nothing may refer to it
+static void UnregisterQueueHotKeys(const struct S_HKQUEUE *queue) {
+	int i = 0;
 
-static int global_GetTempPath(lua_State *L) {
-    DWORD rc;
-    char tfn[MAX_PATH*4];
+	while (i < hotKeys.count) {
+		if (hotKeys.keys[i].queue == queue)
+			RemoveHotKeyAt(i);
+		else
+			i++;
+	}
+}
 
-    rc = GetTempPath( sizeof(tfn)-1, tfn);
+static BOOL RegisterHotKeyEntry(const struct S_HKT *s) {
+	struct S_HKT *e;
 
-    lua_pushnumber( L, rc);
-    if( rc)
-        lua_pushstring( L, tfn);
-    else
-        lua_pushnil( L);
+	UnregisterHotKeyEntry(s->queue, s->id);
 
-    return( 2);
+	if (hotKeys.count == hotKeys.capacity) {
+		const int capacity = hotKeys.capacity ? hotKeys.capacity * 2 : 16;
+		struct S_HKT *keys = realloc(hotKeys.keys, capacity * sizeof(*keys));
+		if (keys == NULL)
+			return FALSE;
+		hotKeys.keys = keys;
+		hotKeys.capacity = capacity;
+	}
+	e = &hotKeys.keys[hotKeys.count];
+	*e = *s;
+	do
+		e->atom = hotKeys.lastAtom = (hotKeys.lastAtom + 1) % (HOTKEY_MAXATOM + 1);
+	while (FindHotKeyAtom(e->atom) >= 0);
+	if (!RegisterHotKey(hotKeys.hwnd, e->atom, e->mdfs, e->vk))
+		return FALSE;
+	hotKeys.count++;
+
+	return TRUE;
 }
-/***/
 
-/****if* luaw32/global_CreateFile
-* NAME
-*  global_CreateFile
-* FUNCTION
-*  Win32 CreateFile.
-* INPUTS
-*  L: Lua state
-*  stack[1]: Name of the object to create or open
-*  stack[2]: Specifies the type of access to the object
-*  stack[3]: Specifies how the object can be shared
-*  stack[4]: Table:
-*            .bInheritHandle: determines whether the returned handle
-*                             can be inherited by child processes
-*  stack[5]: Specifies which action to take on files that exist
-*  stack[6]: Specifies the file attributes and flags for the file
-*  stack[7]: Specifies a handle with GENERIC_READ access to a
-*            template file
-* RESULT
-*  stack[1]: Handle
-* SOURCE
-*/
+static void QueueHotKey(struct S_HKQUEUE *q, int id) {
+	const LONG tail = q->tail;
+
+	if (tail - q->head >= HOTKEY_QUEUE_SIZE) {
+		InterlockedIncrement(&q->lost);
+		return;
+	}
+	q->ids[tail % HOTKEY_QUEUE_SIZE] = id;
+	InterlockedExchange(&q->tail, tail + 1);    // publishes the entry
+}
+
+static LRESULT CALLBACK HotKeyWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
+	const struct S_HKT *e;
+	int i;
+
+	switch (msg) {
+	case HK_REGISTER:
+		return RegisterHotKeyEntry((const struct S_HKT *)lparam);
+	case HK_UNREGISTER:
+		return UnregisterHotKeyEntry((const struct S_HKQUEUE *)lparam, (int)wparam);
+	case HK_UNREGISTERALL:
+		UnregisterQueueHotKeys((const struct S_HKQUEUE *)lparam);
+		return 0;
+	case WM_HOTKEY:
+		i = FindHotKeyAtom((int)wparam);
+		if (i < 0)
+			return 0;
+		e = &hotKeys.keys[i];
+		QueueHotKey(e->queue, e->id);
+		if (e->hwnd != NULL)
+			PostMessage(e->hwnd, e->umsg, e->wparam, e->lparam);
+		return 0;
+	}
+
+	return DefWindowProc(hwnd, msg, wparam, lparam);
+}
+
+static void HotKeyThread( void *v) {
+	HANDLE ready = (HANDLE)v;
+	WNDCLASSEX wc;
+	HMODULE hmod;
+	MSG msg;
+
+	// the window procedure lives in this dll, keep it loaded while the thread lives
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+	                  (LPCSTR)HotKeyWndProc, &hmod);
+
+	memset(&wc, 0, sizeof(wc));
+	wc.cbSize = sizeof(wc);
+	wc.lpfnWndProc = HotKeyWndProc;
+	wc.hInstance = hmod;
+	wc.lpszClassName = HOTKEY_CLASS;
+	RegisterClassEx(&wc);
+
+	hotKeys.hwnd = CreateWindowEx(0, HOTKEY_CLASS, NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hmod, NULL);
+	SetEvent(ready);
+
+	if (hotKeys.hwnd != NULL)
+		while (GetMessage(&msg, NULL, 0, 0) > 0)
+			DispatchMessage(&msg);
+}
+
+static BOOL CALLBACK StartHotKeyThreadOnce(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+	HANDLE ready = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (ready == NULL)
+		return TRUE;
+	if (_beginthread(HotKeyThread, 0, ready) != (uintptr_t)-1L)
+		WaitForSingleObject(ready, INFINITE);
+	CloseHandle(ready);
+
+	return TRUE;
+}
+
+// returns the service window or NULL when the thread could not be started
+static HWND StartHotKeyThread(void) {
+	InitOnceExecuteOnce(&hotKeysOnce, StartHotKeyThreadOnce, NULL, NULL);
+	return hotKeys.hwnd;
+}
+
+// returns the hotkey queue of the Lua state, NULL when it has none and create is FALSE
+static struct S_HKQUEUE *GetHotKeyQueue(lua_State *L, BOOL create) {
+	struct S_HKQUEUE *q;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HOTKEY_KEY);
+	q = (struct S_HKQUEUE *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (q != NULL || !create)
+		return q;
+
+	// the registry keeps the userdata until lua_close, its __gc unregisters the state's hotkeys
+	q = (struct S_HKQUEUE *)lua_newuserdata(L, sizeof(struct S_HKQUEUE));
+	memset(q, 0, sizeof(*q));
+	luaL_getmetatable(L, HOTKEY_MT);
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, HOTKEY_KEY);
+
+	return q;
+}
+
+static int hotkeyqueue_gc(lua_State *L) {
+	struct S_HKQUEUE *q = (struct S_HKQUEUE *)luaL_checkudata(L, 1, HOTKEY_MT);
+
+	if (hotKeys.hwnd != NULL)
+		SendMessage(hotKeys.hwnd, HK_UNREGISTERALL, 0, (LPARAM)q);
+
+	return 0;
+}
+
+static const luaL_Reg hotkeyqueue_methods[] = {
+	{"__gc", hotkeyqueue_gc},
+	{NULL, NULL}
+};
+
+// Lua:  RegisterHotKey(hwnd, id, modifiers, vk, msg, wparam, lparam)
+//       ids are private to the calling script, registering an id again replaces it
+//       hwnd 0 - the hotkey is only queued for PollHotKeys, otherwise msg is posted to hwnd too
+//       returns 0 - ok, -2 - service thread is not available, -3 - RegisterHotKey failed
+static int global_RegisterHotKey(lua_State *L) {
+    struct S_HKT s;
+    HWND service;
+
+    s.hwnd = ( HWND)( INT_PTR) luaL_checkinteger( L, 1);
+    s.id = ( int) luaL_checkinteger( L, 2);
+    s.mdfs = ( UINT) luaL_checkinteger( L, 3);
+    s.vk = ( UINT) luaL_checkinteger( L, 4);
+    s.umsg = ( UINT) luaL_optinteger( L, 5, 0);
+    s.wparam = ( WPARAM) luaL_optinteger( L, 6, 0);
+    s.lparam = ( LPARAM) luaL_optinteger( L, 7, 0);
+    s.atom = 0;
+
+    service = StartHotKeyThread();
+    if( service == NULL) {
+        lua_pushnumber( L, -2);
+        return( 1);
+    }
+
+    s.queue = GetHotKeyQueue( L, TRUE);
+    if( !SendMessage( service, HK_REGISTER, 0, ( LPARAM) &s))
+        lua_pushnumber( L, -3);
+    else
+        lua_pushnumber( L, 0);
+
+    return( 1);
+}
+
+// Lua:  UnregisterHotKey(id), returns true when the script had registered the hotkey
+static int global_UnregisterHotKey(lua_State *L) {
+	const int id = (int)luaL_checkinteger(L, 1);
+	const struct S_HKQUEUE *q = GetHotKeyQueue(L, FALSE);
+
+	// no queue - the script never registered a hotkey and the service thread is not needed
+	lua_pushboolean(L, q != NULL && hotKeys.hwnd != NULL &&
+	                   SendMessage(hotKeys.hwnd, HK_UNREGISTER, (WPARAM)id, (LPARAM)q));
+
+	return 1;
+}
+
+// Lua:  PollHotKeys(max), max = nil - all
+//       returns array of hotkey ids pressed since the last call of the calling script,
+//       their number and number of lost presses
+static int global_PollHotKeys(lua_State *L) {
+	const int max = (int)luaL_optinteger(L, 1, 0);
+	struct S_HKQUEUE *q = GetHotKeyQueue(L, FALSE);
+	int n = 0;
+
+	lua_newtable(L);
+	while (q != NULL && (max <= 0 || n < max)) {
+		const LONG head = q->head;
+		LONG id;
+		if (head == q->tail)
+			break;
+		id = q->ids[head % HOTKEY_QUEUE_SIZE];
+		// another poller may have taken the entry; the producer reuses a slot only after head passed it
+		if (InterlockedCompareExchange(&q->head, head + 1, head) != head)
+			continue;
+		lua_pushinteger(L, id);
+		lua_rawseti(L, -2, ++n);
+	}
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, q != NULL ? InterlockedExchange(&q->lost, 0) : 0);
+
+	return 3;
+}
+
+static int global_SetForegroundWindow(lua_State *L) {
+	auto hwnd = luaL_checkinteger(L, 1);
+	BOOL rc = SetForegroundWindow((HWND)hwnd);
+	lua_pushinteger(L, rc == TRUE);
+
+	return 1;
+}
+
+static int global_PostMessage(lua_State *L) {
+	auto hwnd = lua_checkint64(L, 1);
+	UINT msg = (UINT)lua_checkint64(L, 2);
+	WPARAM wparam = (WPARAM)lua_checkint64(L, 3);
+	LPARAM lparam = (LPARAM)lua_checkint64(L, 4);
+
+    BOOL rc = PostMessage((HWND)hwnd, msg, wparam, lparam);
+
+	lua_pushboolean(L, rc == TRUE);
+
+    return 1;
+}
+
+static int global_SendMessage(lua_State *L) {
+	auto hwnd = lua_checkint64(L, 1);
+	UINT msg = (UINT)lua_checkint64(L, 2);
+	WPARAM wparam = (WPARAM)lua_checkint64(L, 3);
+	LPARAM lparam = (LPARAM)lua_checkint64(L, 4);
+
+	LRESULT rc = SendMessage((HWND)hwnd, msg, wparam, lparam);
+
+	lua_pushint64(L, rc);
+
+	return 1;
+}
+
+/* Message batches: the whole batch is validated before the first message goes out */
+
+struct S_MSGITEM {
+	HWND hwnd;
+	UINT msg;
+	WPARAM wparam;
+	LPARAM lparam;
+};
+
+// reads {{hwnd, msg, wparam, lparam}, ...} at index idx, wparam and lparam default to 0
+// the items array is a userdata left on the stack, so an argument error does not leak it
+static struct S_MSGITEM *CheckMessageBatch(lua_State *L, int idx, int *count) {
+	struct S_MSGITEM *items;
+	lua_Integer v[4];
+	int n, i, j;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = (int)lua_rawlen(L, idx);
+	items = (struct S_MSGITEM *)lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(*items));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		if (!lua_istable(L, -1)) {
+			luaL_error(L, "message %d: table {hwnd, msg, wparam, lparam} expected", i + 1);
+			return NULL;
+		}
+		for (j = 0; j < 4; j++) {
+			lua_rawgeti(L, -1, j + 1);
+			if (lua_isnumber(L, -1))
+				v[j] = lua_tointeger(L, -1);
+			else if (j >= 2 && lua_isnil(L, -1))
+				v[j] = 0;
+			else {
+				luaL_error(L, "message %d: integer expected at position %d", i + 1, j + 1);
+				return NULL;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+		items[i].hwnd = (HWND)(INT_PTR)v[0];
+		items[i].msg = (UINT)v[1];
+		items[i].wparam = (WPARAM)v[2];
+		items[i].lparam = (LPARAM)v[3];
+	}
+	*count = n;
+
+	return items;
+}
+
+// Lua:  PostMessages({{hwnd, msg, wparam, lparam}, ...})
+//       returns array of booleans and number of posted messages
+static int global_PostMessages(lua_State *L) {
+	int n, i, posted = 0;
+	const struct S_MSGITEM *items = CheckMessageBatch(L, 1, &n);
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		const BOOL rc = PostMessage(items[i].hwnd, items[i].msg, items[i].wparam, items[i].lparam);
+		posted += rc != FALSE;
+		lua_pushboolean(L, rc != FALSE);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, posted);
+
+	return 2;
+}
+
+// Lua:  SendMessages({{hwnd, msg, wparam, lparam}, ...})
+//       returns array of results and number of messages
+static int global_SendMessages(lua_State *L) {
+	int n, i;
+	const struct S_MSGITEM *items = CheckMessageBatch(L, 1, &n);
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushint64(L, SendMessage(items[i].hwnd, items[i].msg, items[i].wparam, items[i].lparam));
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushinteger(L, n);
+
+	return 2;
+}
+
+/* Timeout-bounded sends: a busy or hung target thread can not block the script */
+
+#define SEND_TIMEOUT_DEFAULT    1000
+
+// returns FALSE on failure, *timedOut tells whether the time limit was the reason
+static BOOL SendMessageBounded(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam,
+                               UINT flags, UINT timeout, DWORD_PTR *result, BOOL *timedOut) {
+	*result = 0;
+	*timedOut = FALSE;
+
+	if (SendMessageTimeout(hwnd, msg, wparam, lparam, flags, timeout, result))
+		return TRUE;
+
+	*timedOut = GetLastError() == ERROR_TIMEOUT;
+	return FALSE;
+}
+
+// the same through SendMessageTimeoutW, text messages are marshalled as UTF-16
+static BOOL SendMessageBoundedW(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam,
+                                UINT flags, UINT timeout, DWORD_PTR *result, BOOL *timedOut) {
+	*result = 0;
+	*timedOut = FALSE;
+
+	if (SendMessageTimeoutW(hwnd, msg, wparam, lparam, flags, timeout, result))
+		return TRUE;
+
+	*timedOut = GetLastError() == ERROR_TIMEOUT;
+	return FALSE;
+}
+
+// time left of timeout since start, 0 when it is over
+static UINT RemainingTimeout(UINT timeout, DWORD start) {
+	const DWORD elapsed = GetTickCount() - start;
+	return elapsed < timeout ? timeout - elapsed : 0;
+}
+
+// Lua:  returns nil, "timeout" or nil, "error"
+static int PushSendFailure(lua_State *L, BOOL timedOut) {
+	lua_pushnil(L);
+	lua_pushstring(L, timedOut ? "timeout" : "error");
+	return 2;
+}
+
+/* A buffer handed to a target that timed out may still be written by it, so it is freed
+   by the callback of WM_NULL sent after the timed-out message: the target handles sent
+   messages in order. Callbacks run while the sending thread retrieves messages, so the
+   busy check collects them first: a QUIK main() does not pump */
+
+#define LATE_BUFFERS_MAX    64
+
+static LONG lateBuffers;    // handed to targets and not freed yet
+
+static VOID CALLBACK FreeLateBufferProc(HWND hwnd, UINT msg, ULONG_PTR data, LRESULT result) {
+	free((void *)data);
+	InterlockedDecrement(&lateBuffers);
+}
+
+// frees buf once hwnd has handled the timed-out message, or at once when the callback
+// can not be queued (the target is gone); a hung target keeps it, so sends needing
+// a buffer are refused while LATE_BUFFERS_MAX are held
+static void ReleaseLateBuffer(HWND hwnd, void *buf) {
+	InterlockedIncrement(&lateBuffers);
+	if (!SendMessageCallback(hwnd, WM_NULL, 0, 0, FreeLateBufferProc, (ULONG_PTR)buf))
+		FreeLateBufferProc(hwnd, WM_NULL, (ULONG_PTR)buf, 0);
+}
+
+// runs the callbacks queued for the calling thread before refusing: PeekMessage delivers
+// them with other sent messages and leaves posted messages in the queue
+static BOOL LateBuffersBusy(void) {
+	MSG m;
+
+	if (lateBuffers >= LATE_BUFFERS_MAX)
+		PeekMessage(&m, NULL, 0, 0, PM_NOREMOVE | PM_QS_SENDMESSAGE);
+
+	return lateBuffers >= LATE_BUFFERS_MAX;
+}
+
+// Lua:  returns nil, "busy" when too many buffers wait for late replies
+static int PushLateBuffersBusy(lua_State *L) {
+	lua_pushnil(L);
+	lua_pushstring(L, "busy");
+	return 2;
+}
+
+// Lua:  SendMessageTimeout(hwnd, msg, wparam, lparam, timeoutMs, flags)
+//       returns message result or nil, "timeout" | "error"
+static int global_SendMessageTimeout(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+	const UINT msg = (UINT)luaL_checkinteger(L, 2);
+	const WPARAM wparam = (WPARAM)luaL_checkinteger(L, 3);
+	const LPARAM lparam = (LPARAM)luaL_checkinteger(L, 4);
+	const UINT timeout = (UINT)luaL_optinteger(L, 5, SEND_TIMEOUT_DEFAULT);
+	const UINT flags = (UINT)luaL_optinteger(L, 6, SMTO_ABORTIFHUNG);
+	DWORD_PTR result;
+	BOOL timedOut;
+
+	if (!SendMessageBounded(hwnd, msg, wparam, lparam, flags, timeout, &result, &timedOut))
+		return PushSendFailure(L, timedOut);
+
+	lua_pushint64(L, (LRESULT)result);
+
+	return 1;
+}
+
+// Lua:  SendCopyData(hwnd, id, bytes, timeoutMs)
+//       sends WM_COPYDATA, returns the receiver's result or nil, "timeout" | "error"
+static int global_SendCopyData(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+	const ULONG_PTR id = (ULONG_PTR)luaL_checkinteger(L, 2);
+	size_t len;
+	const char *data = luaL_checklstring(L, 3, &len);
+	const UINT timeout = (UINT)luaL_optinteger(L, 4, SEND_TIMEOUT_DEFAULT);
+	COPYDATASTRUCT cds;
+	DWORD_PTR result;
+	BOOL timedOut;
+
+	cds.dwData = id;
+	cds.cbData = (DWORD)len;
+	cds.lpData = (PVOID)data;
+	if (!SendMessageBounded(hwnd, WM_COPYDATA, 0, (LPARAM)&cds, SMTO_ABORTIFHUNG, timeout, &result, &timedOut))
+		return PushSendFailure(L, timedOut);
+
+	lua_pushint64(L, (LRESULT)result);
+
+	return 1;
+}
+
+// Lua:  GetWindowTextTimeout(hwnd, timeoutMs)
+//       returns text or nil, "timeout" | "error" | "busy"
+static int global_GetWindowTextTimeout(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+	const UINT timeout = (UINT)luaL_optinteger(L, 2, SEND_TIMEOUT_DEFAULT);
+	const UINT cp = GetTextCodePage(L);
+	const DWORD start = GetTickCount();
+	DWORD_PTR len, rc;
+	BOOL timedOut;
+	WCHAR *buf;
+
+	if (!SendMessageBoundedW(hwnd, WM_GETTEXTLENGTH, 0, 0, SMTO_ABORTIFHUNG, timeout, &len, &timedOut))
+		return PushSendFailure(L, timedOut);
+
+	if (LateBuffersBusy())
+		return PushLateBuffersBusy(L);
+	buf = malloc((len + 1) * sizeof(WCHAR));
+	if (buf == NULL)
+		return PushSendFailure(L, FALSE);
+
+	if (!SendMessageBoundedW(hwnd, WM_GETTEXT, len + 1, (LPARAM)buf, SMTO_ABORTIFHUNG,
+	                         RemainingTimeout(timeout, start), &rc, &timedOut)) {
+		// the target may still fill the buffer after the timeout
+		if (timedOut)
+			ReleaseLateBuffer(hwnd, buf);
+		else
+			free(buf);
+		return PushSendFailure(L, timedOut);
+	}
+
+	PushWide(L, cp, buf, (int)(rc <= len ? rc : len));
+	free(buf);
+
+	return 1;
+}
+
+/* Asynchronous sends: SendMessageCallback results are queued per sending thread.
+   Callbacks run on the thread that sent the message while it retrieves messages,
+   so every script thread has its own ring and no locking is needed */
+
+#define COMPLETIONS_SIZE    1024    // power of 2
+
+struct S_COMPLETION {
+	ULONG_PTR id;
+	LRESULT result;
+};
+
+struct S_COMPLETIONS {
+	LONG pending;           // sent, callback not called yet
+	LONG lost;              // dropped because the ring was full
+	unsigned head, tail;
+	struct S_COMPLETION ring[COMPLETIONS_SIZE];
+};
+
+static __declspec(thread) struct S_COMPLETIONS *completions;
+static __declspec(thread) ULONG_PTR lastRequestId;
+static __declspec(thread) ULONG_PTR closedRequestId;    // requests up to it were dropped by CloseCompletions
+
+static VOID CALLBACK SendAsyncProc(HWND hwnd, UINT msg, ULONG_PTR id, LRESULT result) {
+	struct S_COMPLETIONS *c = completions;
+
+	if (c == NULL || id <= closedRequestId)
+		return;
+	c->pending--;
+	if (c->tail - c->head == COMPLETIONS_SIZE) {
+		c->lost++;
+		return;
+	}
+	c->ring[c->tail % COMPLETIONS_SIZE].id = id;
+	c->ring[c->tail % COMPLETIONS_SIZE].result = result;
+	c->tail++;
+}
+
+// Lua:  SendMessageAsync(hwnd, msg, wparam, lparam)
+//       returns request id or nil, "error"; the result is taken by PollCompletions
+static int global_SendMessageAsync(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+	const UINT msg = (UINT)luaL_checkinteger(L, 2);
+	const WPARAM wparam = (WPARAM)luaL_checkinteger(L, 3);
+	const LPARAM lparam = (LPARAM)luaL_checkinteger(L, 4);
+	struct S_COMPLETIONS *c = completions;
+
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL)
+			return PushSendFailure(L, FALSE);
+		completions = c;
+	}
+
+	c->pending++;
+	if (!SendMessageCallback(hwnd, msg, wparam, lparam, SendAsyncProc, lastRequestId + 1)) {
+		c->pending--;
+		return PushSendFailure(L, FALSE);
+	}
+	lua_pushinteger(L, (lua_Integer)++lastRequestId);
+
+	return 1;
+}
+
+// Lua:  PollCompletions(max), max = nil - all
+//       returns arrays of request ids and results, their number and number of lost completions
+static int global_PollCompletions(lua_State *L) {
+	const int max = (int)luaL_optinteger(L, 1, 0);
+	struct S_COMPLETIONS *c = completions;
+	MSG msg;
+	int n = 0;
+
+	// lets the system call the callbacks of already answered messages
+	PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	if (c == NULL) {
+		lua_pushinteger(L, 0);
+		lua_pushinteger(L, 0);
+		return 4;
+	}
+
+	while (c->head != c->tail && (max <= 0 || n < max)) {
+		const struct S_COMPLETION *e = &c->ring[c->head % COMPLETIONS_SIZE];
+		n++;
+		lua_pushinteger(L, (lua_Integer)e->id);
+		lua_rawseti(L, -3, n);
+		lua_pushint64(L, e->result);
+		lua_rawseti(L, -2, n);
+		c->head++;
+	}
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, c->lost);
+	c->lost = 0;
+
+	// nothing in flight: the ring is allocated again by the next SendMessageAsync
+	if (c->head == c->tail && c->pending == 0) {
+		completions = NULL;
+		free(c);
+	}
+
+	return 4;
+}
+
+// Lua:  CloseCompletions() frees the ring of the calling thread even when targets
+//       never answered; results of the requests sent so far are dropped, including
+//       those not taken by PollCompletions yet. Returns number of unanswered requests
+static int global_CloseCompletions(lua_State *L) {
+	struct S_COMPLETIONS *c = completions;
+
+	closedRequestId = lastRequestId;
+	if (c == NULL) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	lua_pushinteger(L, c->pending);
+	completions = NULL;
+	free(c);
+
+	return 1;
+}
+
+static int global_PostThreadMessage(lua_State *L) {
+    BOOL rc;
+    DWORD tid = ( DWORD)luaL_checkinteger(L, 1);
+    UINT msg = ( UINT)luaL_checkinteger(L, 2);
+    WPARAM wparam = ( WPARAM)luaL_checkinteger(L, 3);
+    LPARAM lparam = ( LPARAM)luaL_checkinteger(L, 4);
+
+    rc = PostThreadMessage( tid, msg, wparam, lparam);
+
+	lua_pushinteger( L, rc);
+
+    return( 1);
+}
+
+/* Message filter of the Lua state: messages outside of it are dispatched or dropped in C
+   and never reach the script. WM_QUIT and messages above 0xFFFF always pass */
+
+#define MSGFILTER_KEY   "w32.msgfilter"
+
+struct S_MSGFILTER {
+	BOOL drop;
+	unsigned char bits[0x10000 / 8];
+};
+
+static const struct S_MSGFILTER *GetMessageFilter(lua_State *L) {
+	const struct S_MSGFILTER *f;
+
+	// the registry keeps the userdata alive until SetMessageFilter replaces it
+	lua_getfield(L, LUA_REGISTRYINDEX, MSGFILTER_KEY);
+	f = (const struct S_MSGFILTER *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return f;
+}
+
+static BOOL PassMessage(const struct S_MSGFILTER *f, const MSG *m) {
+	if (f == NULL || m->message > 0xFFFF || m->message == WM_QUIT)
+		return TRUE;
+
+	return (f->bits[m->message >> 3] >> (m->message & 7)) & 1;
+}
+
+// WM_PAINT is synthesized while the window stays invalid and PeekMessage never takes it
+// off the queue: only BeginPaint in the window procedure validates it, so dropping it
+// would return the same message forever. It is always dispatched, even in "drop" mode
+static BOOL DropsMessage(const struct S_MSGFILTER *f, const MSG *m) {
+	return f->drop && m->message != WM_PAINT;
+}
+
+static void SkipMessage(const struct S_MSGFILTER *f, const MSG *m) {
+	if (!DropsMessage(f, m)) {
+		TranslateMessage(m);
+		DispatchMessage(m);
+	}
+}
+
+static BOOL GetFilteredMessage(lua_State *L, MSG *m, HWND hwnd, UINT mfmin, UINT mfmax) {
+	const struct S_MSGFILTER *f = GetMessageFilter(L);
+	BOOL rc;
+
+	while ((rc = GetMessage(m, hwnd, mfmin, mfmax)) > 0 && !PassMessage(f, m))
+		SkipMessage(f, m);
+
+	return rc;
+}
+
+static BOOL PeekFilteredMessage(lua_State *L, MSG *m, HWND hwnd, UINT mfmin, UINT mfmax, UINT remove) {
+	const struct S_MSGFILTER *f = GetMessageFilter(L);
+
+	while (PeekMessage(m, hwnd, mfmin, mfmax, remove)) {
+		if (PassMessage(f, m))
+			return TRUE;
+		if (!(remove & PM_REMOVE)) {
+			MSG skipped;
+			// a skipped message has to leave the queue to get to the next one; the filter
+			// narrowed to its window and id removes it even when another message arrived
+			// in front of it, and the loop peeks again without removing
+			if (!PeekMessage(&skipped, m->hwnd != NULL ? m->hwnd : (HWND)-1,
+			                 m->message, m->message, remove | PM_REMOVE))
+				return FALSE;
+			// the range 0..0 of WM_NULL means any message: one that passes is dispatched, not lost
+			if (PassMessage(f, &skipped)) {
+				TranslateMessage(&skipped);
+				DispatchMessage(&skipped);
+			}
+			else
+				SkipMessage(f, &skipped);
+			continue;
+		}
+		SkipMessage(f, m);
+	}
+
+	return FALSE;
+}
+
+// Lua:  SetMessageFilter({[WM_COMMAND] = true, ...} | {WM_COMMAND, ...} | nil, "dispatch" | "drop")
+//       nil removes the filter; "drop" still dispatches WM_PAINT, it stays queued until painted
+static int global_SetMessageFilter(lua_State *L) {
+	static const char *const modes[] = {"dispatch", "drop", NULL};
+	struct S_MSGFILTER *f;
+
+	if (lua_isnoneornil(L, 1)) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, MSGFILTER_KEY);
+		return 0;
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	f = (struct S_MSGFILTER *)lua_newuserdata(L, sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	f->drop = luaL_checkoption(L, 2, "dispatch", modes) == 1;
+
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		lua_Integer msg = -1;
+		if (lua_isboolean(L, -1)) {
+			if (lua_toboolean(L, -1) && lua_type(L, -2) == LUA_TNUMBER)
+				msg = lua_tointeger(L, -2);
+		}
+		else if (lua_type(L, -1) == LUA_TNUMBER)
+			msg = lua_tointeger(L, -1);
+		if (msg >= 0 && msg <= 0xFFFF)
+			f->bits[msg >> 3] |= (unsigned char)(1 << (msg & 7));
+		lua_pop(L, 1);
+	}
+	lua_setfield(L, LUA_REGISTRYINDEX, MSGFILTER_KEY);
+
+	return 0;
+}
+
+/* Reusable MSG userdata: GetMessage/PeekMessage fill it in place */
+
+#define MSG_MT          "w32.Msg"
+
+// returns MSG of w32.Msg userdata at idx or NULL when it is something else
+static MSG *TestMsg(lua_State *L, int idx) {
+	return (MSG *)TestUdata(L, idx, MSG_MT);
+}
+
+// Lua:  newMsg(), returns w32.Msg with integer fields hwnd, message, wParam, lParam, time, x, y
+static int global_newMsg(lua_State *L) {
+	MSG *m = (MSG *)lua_newuserdata(L, sizeof(MSG));
+
+	memset(m, 0, sizeof(*m));
+	luaL_getmetatable(L, MSG_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int msg_dispatch(lua_State *L) {
+	const MSG *m = (const MSG *)luaL_checkudata(L, 1, MSG_MT);
+
+	lua_pushint64(L, DispatchMessage(m));
+
+	return 1;
+}
+
+static int msg_index(lua_State *L) {
+	const MSG *m = (const MSG *)luaL_checkudata(L, 1, MSG_MT);
+	const char *key = luaL_checkstring(L, 2);
+
+	if (strcmp(key, "hwnd") == 0)
+		lua_pushhwnd(L, m->hwnd);
+	else if (strcmp(key, "message") == 0)
+		lua_pushinteger(L, m->message);
+	else if (strcmp(key, "wParam") == 0)
+		lua_pushint64(L, (lua_Integer)m->wParam);
+	else if (strcmp(key, "lParam") == 0)
+		lua_pushint64(L, (lua_Integer)m->lParam);
+	else if (strcmp(key, "time") == 0)
+		lua_pushinteger(L, m->time);
+	else if (strcmp(key, "x") == 0)
+		lua_pushinteger(L, m->pt.x);
+	else if (strcmp(key, "y") == 0)
+		lua_pushinteger(L, m->pt.y);
+	else if (strcmp(key, "dispatch") == 0)
+		lua_pushcfunction(L, msg_dispatch);
+	else
+		lua_pushnil(L);
+
+	return 1;
+}
+
+static int msg_tostring(lua_State *L) {
+	const MSG *m = (const MSG *)luaL_checkudata(L, 1, MSG_MT);
+
+	lua_pushfstring(L, MSG_MT ": 0x%04x", (unsigned)m->message);
+
+	return 1;
+}
+
+static const luaL_Reg msg_methods[] = {
+	{"__index", msg_index},
+	{"__tostring", msg_tostring},
+	{NULL, NULL}
+};
+
+// Lua:  GetMessage(msg, hwnd, min, max), fills msg and returns GetMessage result
+static int GetMessageInto(lua_State *L, MSG *m) {
+	const HWND hwnd = (HWND)(INT_PTR)luaL_optinteger(L, 2, 0);
+	const UINT mfmin = (UINT)luaL_optinteger(L, 3, 0);
+	const UINT mfmax = (UINT)luaL_optinteger(L, 4, 0);
+
+	lua_pushinteger(L, GetFilteredMessage(L, m, hwnd, mfmin, mfmax));
+
+	return 1;
+}
+
+// Lua:  PeekMessage(msg, hwnd, min, max, remove), fills msg and returns PeekMessage result
+static int PeekMessageInto(lua_State *L, MSG *m) {
+	const HWND hwnd = (HWND)(INT_PTR)luaL_optinteger(L, 2, 0);
+	const UINT mfmin = (UINT)luaL_optinteger(L, 3, 0);
+	const UINT mfmax = (UINT)luaL_optinteger(L, 4, 0);
+	const UINT remove = (UINT)luaL_optinteger(L, 5, PM_NOREMOVE);
+
+	lua_pushinteger(L, PeekFilteredMessage(L, m, hwnd, mfmin, mfmax, remove));
+
+	return 1;
+}
+
+// Lua:  PeekMessages({msg1, msg2, ...}, n, hwnd, min, max)
+//       removes up to n (nil - size of array) messages into the w32.Msg slots, returns their number
+static int global_PeekMessages(lua_State *L) {
+	const HWND hwnd = (HWND)(INT_PTR)luaL_optinteger(L, 3, 0);
+	const UINT mfmin = (UINT)luaL_optinteger(L, 4, 0);
+	const UINT mfmax = (UINT)luaL_optinteger(L, 5, 0);
+	int size, n, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	size = (int)lua_rawlen(L, 1);
+	n = (int)luaL_optinteger(L, 2, size);
+
+	for (i = 0; i < n && i < size; i++) {
+		MSG *m;
+		lua_rawgeti(L, 1, i + 1);
+		m = TestMsg(L, -1);
+		lua_pop(L, 1);  // the array keeps the userdata alive
+		if (m == NULL)
+			return luaL_argerror(L, 1, "array of " MSG_MT " expected");
+		if (!PeekFilteredMessage(L, m, hwnd, mfmin, mfmax, PM_REMOVE))
+			break;
+	}
+	lua_pushinteger(L, i);
+
+	return 1;
+}
+
+static int global_GetMessage(lua_State *L) {
+    MSG msg;
+    BOOL rc;
+    MSG *m = TestMsg( L, 1);
+    if( m)
+        return GetMessageInto( L, m);
+    long lwnd = MYP2HCAST luaL_optinteger( L, 1, 0);
+    UINT mfmin = ( UINT) luaL_optinteger( L, 2, 0);
+    UINT mfmax = ( UINT) luaL_optinteger( L, 3, 0);
+
+    rc = GetFilteredMessage( L, &msg, ( HWND) lwnd, mfmin, mfmax);
+
+    lua_pushnumber( L, rc);
+    if( rc) {
+        lua_pushnumber( L, ( long) msg.hwnd);
+        lua_pushnumber( L, msg.message);
+        lua_pushnumber( L, msg.wParam);
+        lua_pushnumber( L, msg.lParam);
+        lua_pushnumber( L, msg.time);
+        lua_pushnumber( L, msg.pt.x);
+        lua_pushnumber( L, msg.pt.y);
+    } else {
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+    }
+
+    return( 8);
+}
+
+static int global_PeekMessage(lua_State *L) {
+    MSG msg;
+    BOOL rc;
+    MSG *m = TestMsg( L, 1);
+    if( m)
+        return PeekMessageInto( L, m);
+    long lwnd = MYP2HCAST luaL_optinteger( L, 1, 0);
+    UINT mfmin = ( UINT) luaL_optinteger( L, 2, 0);
+    UINT mfmax = ( UINT) luaL_optinteger( L, 3, 0);
+    UINT rmmsg = ( UINT) luaL_optinteger( L, 4, PM_NOREMOVE);
+
+    rc = PeekFilteredMessage( L, &msg, ( HWND) lwnd, mfmin, mfmax, rmmsg);
+
+    lua_pushnumber( L, rc);
+    if( rc) {
+        lua_pushnumber( L, ( long) msg.hwnd);
+        lua_pushnumber( L, msg.message);
+        lua_pushnumber( L, msg.wParam);
+        lua_pushnumber( L, msg.lParam);
+        lua_pushnumber( L, msg.time);
+        lua_pushnumber( L, msg.pt.x);
+        lua_pushnumber( L, msg.pt.y);
+    } else {
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+    }
+
+    return( 8);
+}
+
+static int global_ReplyMessage(lua_State *L) {
+    BOOL rc;
+    LRESULT result = ( LRESULT) luaL_checknumber( L, 1);
+
+    rc = ReplyMessage( result);
+
+    lua_pushboolean( L, rc);
+
+    return( 1);
+}
+
+static int global_DispatchMessage(lua_State *L) {
+    MSG msg;
+    LRESULT rc;
+    long hwnd = MYP2HCAST luaL_checknumber( L, 1);
+
+    msg.hwnd = ( HWND) hwnd;
+    msg.message = ( UINT) luaL_checknumber( L, 2);
+    msg.wParam = ( WPARAM) luaL_checknumber( L, 3);
+    msg.lParam = ( LPARAM) luaL_checknumber( L, 4);
+    msg.time = ( DWORD) luaL_checknumber( L, 5);
+    msg.pt.x = ( LONG) luaL_checknumber( L, 6);
+    msg.pt.y = ( LONG) luaL_checknumber( L, 7);
+
+    rc = DispatchMessage( &msg);
+
+    lua_pushnumber( L, rc);
+
+    return( 1);
+}
+
+// removes and dispatches up to max messages, stops at WM_QUIT
+// messages dropped by the filter are not counted
+static int DrainMessages(const struct S_MSGFILTER *f, HWND hwnd, UINT mfmin, UINT mfmax, int max, BOOL *quit) {
+	MSG msg;
+	int n = 0;
+
+	while ((max <= 0 || n < max) && PeekMessage(&msg, hwnd, mfmin, mfmax, PM_REMOVE)) {
+		if (msg.message == WM_QUIT) {
+			*quit = TRUE;
+			break;
+		}
+		if (f != NULL && !PassMessage(f, &msg) && DropsMessage(f, &msg))
+			continue;
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+		n++;
+	}
+
+	return n;
+}
+
+// wake bits of messages in mfmin..mfmax, both 0 - all; sent messages always wake
+// the thread, PeekMessage delivers them whatever the filter
+static UINT FilterWakeMask(UINT mfmin, UINT mfmax) {
+	UINT mask = QS_SENDMESSAGE | QS_POSTMESSAGE;
+
+	if (mfmin == 0 && mfmax == 0)
+		return QS_ALLINPUT;
+	if (mfmin <= WM_KEYLAST && mfmax >= WM_KEYFIRST)
+		mask |= QS_KEY;
+	if (mfmin <= WM_MOUSELAST && mfmax >= WM_MOUSEFIRST)
+		mask |= QS_MOUSE;
+	if (mfmin <= WM_TIMER && mfmax >= WM_TIMER)
+		mask |= QS_TIMER;
+	if (mfmin <= WM_PAINT && mfmax >= WM_PAINT)
+		mask |= QS_PAINT;
+	if (mfmin <= WM_HOTKEY && mfmax >= WM_HOTKEY)
+		mask |= QS_HOTKEY;
+	if (mfmin <= WM_INPUT && mfmax >= WM_INPUT)
+		mask |= QS_RAWINPUT;
+
+	return mask;
+}
+
+// Lua:  PumpMessages(maxCount, timeoutMs, {hwnd = 0, min = 0, max = 0})
+//       waits up to timeoutMs (-1 - infinite) for messages, dispatches up to maxCount (nil - all)
+//       returns number of dispatched messages and true when WM_QUIT was retrieved
+static int global_PumpMessages(lua_State *L) {
+	const int max = (int)luaL_optinteger(L, 1, 0);
+	const lua_Integer t = luaL_optinteger(L, 2, 0);
+	const UINT timeout = t < 0 ? INFINITE : (UINT)t;
+	const DWORD start = GetTickCount();
+	HWND hwnd = NULL;
+	UINT mfmin = 0, mfmax = 0;
+	const struct S_MSGFILTER *f = GetMessageFilter(L);
+	BOOL quit = FALSE;
+	int n;
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "hwnd");
+		hwnd = (HWND)(INT_PTR)lua_tointeger(L, -1);
+		lua_getfield(L, 3, "min");
+		mfmin = (UINT)lua_tointeger(L, -1);
+		lua_getfield(L, 3, "max");
+		mfmax = (UINT)lua_tointeger(L, -1);
+		lua_pop(L, 3);
+	}
+
+	n = DrainMessages(f, hwnd, mfmin, mfmax, max, &quit);
+	while (n == 0 && !quit) {
+		const DWORD left = timeout == INFINITE ? INFINITE : RemainingTimeout(timeout, start);
+		// without MWMO_INPUTAVAILABLE only input arrived after the last PeekMessage wakes
+		// the wait, so messages left in the queue by the hwnd/range filter do not spin it
+		if (left == 0 ||
+		    MsgWaitForMultipleObjectsEx(0, NULL, left, FilterWakeMask(mfmin, mfmax), 0) != WAIT_OBJECT_0)
+			break;
+		n = DrainMessages(f, hwnd, mfmin, mfmax, max, &quit);
+	}
+
+	lua_pushinteger(L, n);
+	lua_pushboolean(L, quit);
+
+	return 2;
+}
+
+/* Window subclassing: messages without a handler go to DefSubclassProc without touching Lua.
+   SetWindowSubclass works only for windows of the calling thread, so the handlers run
+   on the script thread while it retrieves messages */
+
+#define SUBCLASS_KEY    "w32.subclasses"    // registry: [hwnd lightuserdata] = S_SUBCLASS lightuserdata
+#define SUBCLASS_ERR_KEY "w32.subclasserror" // registry: last error raised by a handler
+#define SUBCLASS_GC_MT  "w32.SubclassGuard"
+
+struct S_SUBCLASS {
+	HWND hwnd;
+	lua_State *L;           // own Lua thread: the caller may be a coroutine
+	int threadRef;
+	int handlersRef;        // copy of the handlers table, msg -> function
+	int depth;              // handler calls in progress
+	BOOL removed;           // release when the last handler call returns
+	unsigned char bits[0x10000 / 8];
+};
+
+static void ReleaseSubclass(struct S_SUBCLASS *s) {
+	lua_State *L = s->L;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, s->handlersRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, s->threadRef);
+	free(s);
+}
+
+// pushes registry table of the subclassed windows, with a guard removing them at lua_close
+static void PushSubclassTable(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, SUBCLASS_KEY);
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	lua_newuserdata(L, 1);
+	luaL_getmetatable(L, SUBCLASS_GC_MT);
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, "guard");
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, SUBCLASS_KEY);
+}
+
+static LRESULT CALLBACK SubclassProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam,
+                                     UINT_PTR id, DWORD_PTR ref) {
+	struct S_SUBCLASS *s = (struct S_SUBCLASS *)ref;
+	LRESULT rc = 0;
+
+	if (msg <= 0xFFFF && ((s->bits[msg >> 3] >> (msg & 7)) & 1)) {
+		lua_State *L = s->L;
+		const int top = lua_gettop(L);
+		BOOL handled = FALSE;
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, s->handlersRef);
+		lua_rawgeti(L, -1, msg);
+		lua_pushhwnd(L, hwnd);
+		lua_pushinteger(L, msg);
+		lua_pushint64(L, (lua_Integer)wparam);
+		lua_pushint64(L, (lua_Integer)lparam);
+		s->depth++;
+		if (lua_pcall(L, 4, 1, 0) != 0) {
+			// the window procedure can not raise it: kept for GetSubclassError
+			if (!lua_isstring(L, -1)) {
+				lua_pop(L, 1);
+				lua_pushstring(L, "handler error object is not a string");
+			}
+			lua_setfield(L, LUA_REGISTRYINDEX, SUBCLASS_ERR_KEY);
+		}
+		else if (lua_isnumber(L, -1)) {
+			rc = (LRESULT)lua_tointeger(L, -1);
+			handled = TRUE;
+		}
+		lua_settop(L, top);
+		s->depth--;
+
+		if (s->removed && s->depth == 0) {
+			ReleaseSubclass(s);
+			return handled ? rc : DefSubclassProc(hwnd, msg, wparam, lparam);
+		}
+		if (handled)
+			return rc;
+	}
+
+	rc = DefSubclassProc(hwnd, msg, wparam, lparam);
+
+	if (msg == WM_NCDESTROY && !s->removed) {
+		RemoveWindowSubclass(hwnd, SubclassProc, id);
+		PushSubclassTable(s->L);
+		lua_pushlightuserdata(s->L, hwnd);
+		lua_pushnil(s->L);
+		lua_rawset(s->L, -3);
+		lua_pop(s->L, 1);
+		s->removed = TRUE;
+		if (s->depth == 0)
+			ReleaseSubclass(s);
+	}
+
+	return rc;
+}
+
+// removes subclass of hwnd, the table of subclassed windows is on the stack top
+static BOOL RemoveSubclass(lua_State *L, HWND hwnd) {
+	struct S_SUBCLASS *s;
+
+	lua_pushlightuserdata(L, hwnd);
+	lua_rawget(L, -2);
+	s = (struct S_SUBCLASS *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (s == NULL)
+		return FALSE;
+
+	RemoveWindowSubclass(hwnd, SubclassProc, (UINT_PTR)s);
+	lua_pushlightuserdata(L, hwnd);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	s->removed = TRUE;
+	if (s->depth == 0)
+		ReleaseSubclass(s);
+
+	return TRUE;
+}
+
+static int subclass_gc(lua_State *L) {
+	PushSubclassTable(L);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_islightuserdata(L, -1)) {
+			const HWND hwnd = ((struct S_SUBCLASS *)lua_touserdata(L, -1))->hwnd;
+			lua_pop(L, 2);
+			RemoveSubclass(L, hwnd);
+			lua_pushnil(L);     // the table was changed: start over
+		}
+		else
+			lua_pop(L, 1);
+	}
+
+	return 0;
+}
+
+static const luaL_Reg subclass_guard_methods[] = {
+	{"__gc", subclass_gc},
+	{NULL, NULL}
+};
+
+// Lua:  SubclassWindow(hwnd, {[msg] = function(hwnd, msg, wparam, lparam) ... end, ...})
+//       a handler returns message result or nil to pass the message on; a handler
+//       error passes the message on too and is kept for GetSubclassError
+//       the window must belong to the calling thread, windows of QUIK threads
+//       can not be subclassed from a script; returns true or nil, error
+static int global_SubclassWindow(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+	struct S_SUBCLASS *s;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (GetWindowThreadProcessId(hwnd, NULL) != GetCurrentThreadId()) {
+		lua_pushnil(L);
+		lua_pushstring(L, "window belongs to another thread");
+		return 2;
+	}
+
+	PushSubclassTable(L);
+	RemoveSubclass(L, hwnd);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return luaL_error(L, "not enough memory");
+	s->hwnd = hwnd;
+
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		if (lua_type(L, -2) == LUA_TNUMBER && lua_isfunction(L, -1)) {
+			const lua_Integer msg = lua_tointeger(L, -2);
+			if (msg >= 0 && msg <= 0xFFFF) {
+				s->bits[msg >> 3] |= (unsigned char)(1 << (msg & 7));
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, -4, (int)msg);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	s->handlersRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	s->L = lua_newthread(L);
+	s->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if (!SetWindowSubclass(hwnd, SubclassProc, (UINT_PTR)s, (DWORD_PTR)s)) {
+		ReleaseSubclass(s);
+		lua_pushnil(L);
+		lua_pushstring(L, "SetWindowSubclass failed");
+		return 2;
+	}
+	lua_pushlightuserdata(L, hwnd);
+	lua_pushlightuserdata(L, s);
+	lua_rawset(L, -3);
+	lua_pushboolean(L, 1);
+
+	return 1;
+}
+
+// Lua:  GetSubclassError() returns the last error raised by a handler and clears it,
+//       nil when there was none
+static int global_GetSubclassError(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, SUBCLASS_ERR_KEY);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, SUBCLASS_ERR_KEY);
+
+	return 1;
+}
+
+// Lua:  UnsubclassWindow(hwnd), returns true when the window was subclassed
+static int global_UnsubclassWindow(lua_State *L) {
+	const HWND hwnd = lua_checkhwnd(L, 1);
+
+	PushSubclassTable(L);
+	lua_pushboolean(L, RemoveSubclass(L, hwnd));
+
+	return 1;
+}
+
+/* IPC window: a message-only window on its own thread copies WM_COPYDATA payloads
+   into a byte ring, the script drains it with ipc:read() without pumping messages.
+   Record: DWORD id, DWORD length, data padded to 8 bytes */
+
+#define IPC_MT          "w32.IpcWindow"
+#define IPC_CLASS       "LuaW32IpcWindow"
+#define IPC_RING_SIZE   (1024 * 1024)
+#define IPC_WRAP        0xFFFFFFFF      // length of the filler up to the end of the ring
+#define IPC_ALIGN(n)    (((n) + 7) & ~(size_t)7)
+
+struct S_IPC {
+	volatile LONG refs;     // the script and the window thread
+	HWND hwnd;
+	HANDLE event;           // auto-reset, set when a record is added
+	SRWLOCK lock;           // guards head and tail
+	size_t head, tail;      // ever growing offsets, position is offset % size
+	size_t size;
+	volatile LONG lost;     // payloads rejected because the ring was full
+	const char *name;       // only while the window is being created
+	HANDLE ready;
+	char *buf;
+};
+
+static void ReleaseIpc(struct S_IPC *ipc) {
+	if (InterlockedDecrement(&ipc->refs) == 0) {
+		CloseHandle(ipc->event);
+		free(ipc->buf);
+		free(ipc);
+	}
+}
+
+static BOOL IpcPut(struct S_IPC *ipc, DWORD id, const void *data, DWORD len) {
+	const size_t need = 8 + IPC_ALIGN((size_t)len);
+	size_t tail, pos, waste;
+	BOOL ok;
+
+	AcquireSRWLockShared(&ipc->lock);
+	tail = ipc->tail;
+	pos = tail % ipc->size;
+	waste = pos + need > ipc->size ? ipc->size - pos : 0;
+	ok = tail - ipc->head + waste + need <= ipc->size;
+	ReleaseSRWLockShared(&ipc->lock);
+
+	if (!ok) {
+		InterlockedIncrement(&ipc->lost);
+		return FALSE;
+	}
+	// the reader never touches the free space, so it is filled without the lock
+	if (waste) {
+		((DWORD *)(ipc->buf + pos))[1] = IPC_WRAP;
+		pos = 0;
+	}
+	((DWORD *)(ipc->buf + pos))[0] = id;
+	((DWORD *)(ipc->buf + pos))[1] = len;
+	memcpy(ipc->buf + pos + 8, data, len);
+
+	AcquireSRWLockExclusive(&ipc->lock);
+	ipc->tail = tail + waste + need;
+	ReleaseSRWLockExclusive(&ipc->lock);
+	SetEvent(ipc->event);
+
+	return TRUE;
+}
+
+static LRESULT CALLBACK IpcWndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
+	struct S_IPC *ipc = (struct S_IPC *)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+
+	switch (msg) {
+	case WM_CREATE:
+		SetWindowLongPtr(hwnd, GWLP_USERDATA, (LONG_PTR)((CREATESTRUCT *)lparam)->lpCreateParams);
+		return 0;
+	case WM_COPYDATA: {
+		const COPYDATASTRUCT *cds = (const COPYDATASTRUCT *)lparam;
+		return IpcPut(ipc, (DWORD)cds->dwData, cds->lpData, cds->cbData);
+	}
+	case WM_CLOSE:
+		DestroyWindow(hwnd);
+		return 0;
+	case WM_DESTROY:
+		PostQuitMessage(0);
+		return 0;
+	}
+
+	return DefWindowProc(hwnd, msg, wparam, lparam);
+}
+
+static void IpcThread(void *v) {
+	struct S_IPC *ipc = (struct S_IPC *)v;
+	WNDCLASSEX wc;
+	HMODULE hmod;
+	MSG msg;
+
+	// the window procedure lives in this dll, keep it loaded while the thread lives
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+	                  (LPCSTR)IpcWndProc, &hmod);
+
+	memset(&wc, 0, sizeof(wc));
+	wc.cbSize = sizeof(wc);
+	wc.lpfnWndProc = IpcWndProc;
+	wc.hInstance = hmod;
+	wc.lpszClassName = IPC_CLASS;
+	RegisterClassEx(&wc);   // fails harmlessly when already registered
+
+	ipc->hwnd = CreateWindowEx(0, IPC_CLASS, ipc->name, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, hmod, ipc);
+	SetEvent(ipc->ready);
+
+	if (ipc->hwnd != NULL)
+		while (GetMessage(&msg, NULL, 0, 0) > 0)
+			DispatchMessage(&msg);
+
+	ReleaseIpc(ipc);
+}
+
+static struct S_IPC *CheckIpc(lua_State *L) {
+	struct S_IPC **ud = (struct S_IPC **)luaL_checkudata(L, 1, IPC_MT);
+
+	if (*ud == NULL)
+		luaL_error(L, "IPC window is closed");
+
+	return *ud;
+}
+
+// Lua:  CreateIpcWindow(name, ringSize), returns w32.IpcWindow or nil, error
+//       senders find it with FindWindowEx(HWND_MESSAGE, 0, "LuaW32IpcWindow", name)
+static int global_CreateIpcWindow(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	const size_t size = IPC_ALIGN((size_t)luaL_optinteger(L, 2, IPC_RING_SIZE));
+	struct S_IPC **ud = (struct S_IPC **)lua_newuserdata(L, sizeof(*ud));
+	struct S_IPC *ipc;
+
+	*ud = NULL;
+	luaL_getmetatable(L, IPC_MT);
+	lua_setmetatable(L, -2);
+
+	ipc = calloc(1, sizeof(*ipc));
+	if (ipc == NULL)
+		return luaL_error(L, "not enough memory");
+	ipc->refs = 2;
+	ipc->size = size >= 64 ? size : 64;
+	ipc->name = name;
+	InitializeSRWLock(&ipc->lock);
+	ipc->buf = malloc(ipc->size);
+	ipc->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	ipc->ready = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ipc->buf == NULL || ipc->event == NULL || ipc->ready == NULL ||
+	    _beginthread(IpcThread, 0, ipc) == (uintptr_t)-1L) {
+		if (ipc->ready != NULL)
+			CloseHandle(ipc->ready);
+		ipc->refs = 1;
+		ReleaseIpc(ipc);
+		lua_pushnil(L);
+		lua_pushstring(L, "can not start IPC thread");
+		return 2;
+	}
+	WaitForSingleObject(ipc->ready, INFINITE);
+	CloseHandle(ipc->ready);
+	ipc->name = NULL;
+
+	if (ipc->hwnd == NULL) {
+		ReleaseIpc(ipc);    // the thread has already released its reference
+		lua_pushnil(L);
+		lua_pushstring(L, "can not create IPC window");
+		return 2;
+	}
+	*ud = ipc;
+
+	return 1;
+}
+
+// Lua:  ipc:read(maxMsgs), maxMsgs = nil - all
+//       returns arrays of ids and payloads, their number and number of lost payloads
+static int ipc_read(lua_State *L) {
+	struct S_IPC *ipc = CheckIpc(L);
+	const int max = (int)luaL_optinteger(L, 2, 0);
+	size_t head, tail;
+	int n = 0;
+
+	AcquireSRWLockShared(&ipc->lock);
+	head = ipc->head;
+	tail = ipc->tail;
+	ReleaseSRWLockShared(&ipc->lock);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	// records before tail are complete and the writer does not touch them until head moves
+	while (head != tail && (max <= 0 || n < max)) {
+		const size_t pos = head % ipc->size;
+		const DWORD *hdr = (const DWORD *)(ipc->buf + pos);
+		if (hdr[1] == IPC_WRAP) {
+			head += ipc->size - pos;
+			continue;
+		}
+		n++;
+		lua_pushinteger(L, hdr[0]);
+		lua_rawseti(L, -3, n);
+		lua_pushlstring(L, ipc->buf + pos + 8, hdr[1]);
+		lua_rawseti(L, -2, n);
+		head += 8 + IPC_ALIGN((size_t)hdr[1]);
+	}
+
+	AcquireSRWLockExclusive(&ipc->lock);
+	ipc->head = head;
+	ReleaseSRWLockExclusive(&ipc->lock);
+
+	lua_pushinteger(L, n);
+	lua_pushinteger(L, InterlockedExchange(&ipc->lost, 0));
+
+	return 4;
+}
+
+// Lua:  ipc:wait(timeoutMs), timeoutMs = nil - infinite; returns true when there is data to read
+static int ipc_wait(lua_State *L) {
+	struct S_IPC *ipc = CheckIpc(L);
+	const DWORD timeout = lua_isnoneornil(L, 2) ? INFINITE : (DWORD)luaL_checkinteger(L, 2);
+	const DWORD start = GetTickCount();
+	BOOL ready;
+
+	for (;;) {
+		AcquireSRWLockShared(&ipc->lock);
+		ready = ipc->head != ipc->tail;
+		ReleaseSRWLockShared(&ipc->lock);
+		if (ready)
+			break;
+		// the event stays set by records read without waiting, so a wakeup is rechecked
+		if (WaitForSingleObject(ipc->event, timeout == INFINITE ? INFINITE :
+		                        RemainingTimeout(timeout, start)) != WAIT_OBJECT_0)
+			break;
+	}
+
+	lua_pushboolean(L, ready);
+
+	return 1;
+}
+
+static int ipc_hwnd(lua_State *L) {
+	lua_pushhwnd(L, CheckIpc(L)->hwnd);
+	return 1;
+}
+
+static int ipc_close(lua_State *L) {
+	struct S_IPC **ud = (struct S_IPC **)luaL_checkudata(L, 1, IPC_MT);
+
+	if (*ud != NULL) {
+		PostMessage((*ud)->hwnd, WM_CLOSE, 0, 0);
+		ReleaseIpc(*ud);
+		*ud = NULL;
+	}
+
+	return 0;
+}
+
+static int ipc_tostring(lua_State *L) {
+	struct S_IPC **ud = (struct S_IPC **)luaL_checkudata(L, 1, IPC_MT);
+
+	if (*ud != NULL)
+		lua_pushfstring(L, IPC_MT ": %p", (void *)(*ud)->hwnd);
+	else
+		lua_pushliteral(L, IPC_MT ": closed");
+
+	return 1;
+}
+
+static const luaL_Reg ipc_methods[] = {
+	{"read", ipc_read},
+	{"wait", ipc_wait},
+	{"hwnd", ipc_hwnd},
+	{"close", ipc_close},
+	{"__gc", ipc_close},
+	{"__tostring", ipc_tostring},
+	{NULL, NULL}
+};
+
+static int global_SetTopmost(lua_State *L) {
+    BOOL rc;
+    long hwnd = MYP2HCAST luaL_checknumber( L, 1);
+
+    rc = SetWindowPos( ( HWND) hwnd, HWND_TOPMOST, 0, 0, 0, 0,
+                        SWP_NOMOVE | SWP_NOSIZE);
+
+    lua_pushnumber( L, rc);
+
+    return( 1);
+}
+
+/****if* luaw32/global_GetLastError
+* NAME
+*  global_GetLastError
+* FUNCTION
+*  Win32 GetLastError.
+* RESULT
+*  stack[1]: The calling thread's last-error code value
+* SOURCE
+*/
+
+static int global_GetLastError(lua_State *L) {
+
+    lua_pushnumber( L, GetLastError());
+
+    return( 1);
+}
+/***/
+
+/* Kernel handles as userdata: closed by close(), __gc or __close (Lua 5.4 <close>).
+   Every function taking a handle accepts both w32.Handle and a number */
+
+#define HANDLE_MT       "w32.Handle"
+#define HANDLEMODE_KEY  "w32.handlemode"
+
+enum {HANDLE_KERNEL, HANDLE_FIND, HANDLE_SERVICE};
+
+struct S_HANDLE {
+	HANDLE h;               // NULL when closed or detached
+	int kind;               // which API closes it
+	const char *type;       // object type for __tostring
+};
+
+static BOOL CloseTypedHandle(struct S_HANDLE *uh) {
+	BOOL rc = FALSE;
+
+	if (uh->h != NULL) {
+		switch (uh->kind) {
+		case HANDLE_FIND:
+			rc = FindClose(uh->h);
+			break;
+		case HANDLE_SERVICE:
+			rc = CloseServiceHandle((SC_HANDLE)uh->h);
+			break;
+		default:
+			rc = CloseHandle(uh->h);
+		}
+		uh->h = NULL;
+	}
+
+	return rc;
+}
+
+// pushes w32.Handle, or an integer after SetHandleMode("number")
+static void PushHandle(lua_State *L, HANDLE h, int kind, const char *type) {
+	struct S_HANDLE *uh;
+	BOOL number;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HANDLEMODE_KEY);
+	number = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (number) {
+		lua_pushint64(L, (lua_Integer)(INT_PTR)h);
+		return;
+	}
+
+	uh = (struct S_HANDLE *)lua_newuserdata(L, sizeof(*uh));
+	uh->h = h;
+	uh->kind = kind;
+	uh->type = type;
+	luaL_getmetatable(L, HANDLE_MT);
+	lua_setmetatable(L, -2);
+}
+
+static HANDLE CheckHandle(lua_State *L, int n) {
+	const struct S_HANDLE *uh = (const struct S_HANDLE *)TestUdata(L, n, HANDLE_MT);
+
+	if (uh == NULL)
+		return (HANDLE)(INT_PTR)lua_checkint64(L, n);
+	if (uh->h == NULL)
+		luaL_argerror(L, n, "handle is closed");
+
+	return uh->h;
+}
+
+// closes w32.Handle or a numeric handle of the kind
+static int CloseAnyHandle(lua_State *L, int kind) {
+	struct S_HANDLE *uh = (struct S_HANDLE *)TestUdata(L, 1, HANDLE_MT);
+	struct S_HANDLE number;
+
+	if (uh == NULL) {
+		number.h = (HANDLE)(INT_PTR)lua_checkint64(L, 1);
+		number.kind = kind;
+		uh = &number;
+	}
+	lua_pushboolean(L, CloseTypedHandle(uh));
+
+	return 1;
+}
+
+static int handle_close(lua_State *L) {
+	lua_pushboolean(L, CloseTypedHandle((struct S_HANDLE *)luaL_checkudata(L, 1, HANDLE_MT)));
+	return 1;
+}
+
+static int handle_value(lua_State *L) {
+	const struct S_HANDLE *uh = (const struct S_HANDLE *)luaL_checkudata(L, 1, HANDLE_MT);
+
+	lua_pushint64(L, (lua_Integer)(INT_PTR)uh->h);
+
+	return 1;
+}
+
+// returns the handle as a number, the userdata no longer closes it
+static int handle_detach(lua_State *L) {
+	struct S_HANDLE *uh = (struct S_HANDLE *)luaL_checkudata(L, 1, HANDLE_MT);
+
+	lua_pushint64(L, (lua_Integer)(INT_PTR)uh->h);
+	uh->h = NULL;
+
+	return 1;
+}
+
+static int handle_tostring(lua_State *L) {
+	const struct S_HANDLE *uh = (const struct S_HANDLE *)luaL_checkudata(L, 1, HANDLE_MT);
+
+	if (uh->h != NULL)
+		lua_pushfstring(L, HANDLE_MT " (%s): %p", uh->type, (void *)uh->h);
+	else
+		lua_pushfstring(L, HANDLE_MT " (%s): closed", uh->type);
+
+	return 1;
+}
+
+static const luaL_Reg handle_methods[] = {
+	{"close", handle_close},
+	{"value", handle_value},
+	{"detach", handle_detach},
+	{"__gc", handle_close},
+	{"__close", handle_close},
+	{"__tostring", handle_tostring},
+	{NULL, NULL}
+};
+
+// Lua:  SetHandleMode("object" | "number"), returns previous mode
+//       "number" makes the functions return handles as plain numbers again
+static int global_SetHandleMode(lua_State *L) {
+	static const char *const modes[] = {"object", "number", NULL};
+	const int mode = luaL_checkoption(L, 1, NULL, modes);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HANDLEMODE_KEY);
+	lua_pushstring(L, modes[lua_toboolean(L, -1) ? 1 : 0]);
+	lua_pushboolean(L, mode == 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, HANDLEMODE_KEY);
+
+	return 1;
+}
+
+/****if* luaw32/global_CloseHandle
+* NAME
+*  global_CloseHandle
+* FUNCTION
+*  Win32 CloseHandle.
+* INPUTS
+*  L: Lua state
+*  stack[1]: Handle to an open object
+* RESULT
+*  stack[1]: True if ok.
+* SOURCE
+*/
+
+static int global_CloseHandle(lua_State *L) {
+    return CloseAnyHandle( L, HANDLE_KERNEL);
+}
+/***/
+
+static int global_CreateEvent(lua_State *L) {
+    SECURITY_ATTRIBUTES sa;
+    BOOL mr = ( BOOL) luaL_checknumber( L, 2);
+    BOOL is = ( BOOL) luaL_checknumber( L, 3);
+    const char *name;
+    HANDLE h;
+
+    sa.nLength = sizeof( sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = FALSE;
+
+    if( lua_istable( L, 1)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 1);
+        if( !lua_isnil( L, -1))
+            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 1);
+    }
+    name = lua_tostring( L, 4);
+
+    h = CreateEvent( &sa, mr, is, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "event");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_OpenEvent(lua_State *L) {
+    HANDLE h;
+    DWORD da = ( DWORD) luaL_checknumber( L, 1);
+    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
+    const char *name = luaL_checkstring( L, 3);
+
+    h = OpenEvent( da, ih, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "event");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_PulseEvent(lua_State *L) {
+    HANDLE h = CheckHandle( L, 1);
+
+    lua_pushnumber( L, PulseEvent( ( HANDLE) h));
+
+    return( 1);
+}
+
+static int global_ResetEvent(lua_State *L) {
+    HANDLE h = CheckHandle( L, 1);
+
+    lua_pushnumber( L, ResetEvent( ( HANDLE) h));
+
+    return( 1);
+}
+
+static int global_SetEvent(lua_State *L) {
+    HANDLE h = CheckHandle( L, 1);
+
+    lua_pushnumber( L, SetEvent( ( HANDLE) h));
+
+    return( 1);
+}
+
+static int global_CreateMutex(lua_State *L) {
+    SECURITY_ATTRIBUTES sa;
+    BOOL io = ( BOOL) luaL_checknumber( L, 2);
+    const char *name;
+    HANDLE h;
+
+    sa.nLength = sizeof( sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = FALSE;
+
+    if( lua_istable( L, 1)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 1);
+        if( !lua_isnil( L, -1))
+            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 1);
+    }
+    name = lua_tostring( L, 3);
+
+    h = CreateMutex( &sa, io, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "mutex");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_OpenMutex(lua_State *L) {
+    HANDLE h;
+    DWORD da = ( DWORD) luaL_checknumber( L, 1);
+    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
+    const char *name = luaL_checkstring( L, 3);
+
+    h = OpenMutex( da, ih, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "mutex");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_ReleaseMutex(lua_State *L) {
+    HANDLE h = CheckHandle( L, 1);
+
+    lua_pushnumber( L, ReleaseMutex( ( HANDLE) h));
+
+    return( 1);
+}
+
+static int global_CreateSemaphore(lua_State *L) {
+    SECURITY_ATTRIBUTES sa;
+    long ic = ( long) luaL_checknumber( L, 2);
+    long mc = ( long) luaL_checknumber( L, 3);
+    const char *name;
+    HANDLE h;
+
+    sa.nLength = sizeof( sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = FALSE;
+
+    if( lua_istable( L, 1)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 1);
+        if( !lua_isnil( L, -1))
+            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 1);
+    }
+    name = lua_tostring( L, 4);
+
+    h = CreateSemaphore( &sa, ic, mc, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "semaphore");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_OpenSemaphore(lua_State *L) {
+    HANDLE h;
+    DWORD da = ( DWORD) luaL_checknumber( L, 1);
+    BOOL ih = ( BOOL) luaL_checknumber( L, 2);
+    const char *name = luaL_checkstring( L, 3);
+
+    h = OpenSemaphore( da, ih, name);
+
+    if( h)
+        PushHandle( L, h, HANDLE_KERNEL, "semaphore");
+    else
+        lua_pushnil( L);
+
+    return( 1);
+}
+
+static int global_ReleaseSemaphore(lua_State *L) {
+    long pc;
+    BOOL brc;
+    HANDLE h = CheckHandle( L, 1);
+    long rc = ( long) luaL_checknumber( L, 2);
+
+    brc = ReleaseSemaphore( ( HANDLE) h, rc, &pc);
+    lua_pushnumber( L, brc);
+    if( brc)
+        lua_pushnumber( L, pc);
+    else
+        lua_pushnil( L);
+
+    return( 2);
+}
+
+static int global_CreateProcess(lua_State *L) {
+    SECURITY_ATTRIBUTES psa;
+    SECURITY_ATTRIBUTES tsa;
+    PROCESS_INFORMATION pi;
+    STARTUPINFO si;
+    BOOL brc;
+    char *env;
+    const char *an = luaL_optstring( L, 1, NULL);
+    const char *cl = luaL_optstring( L, 2, NULL);
+    BOOL ih = ( BOOL) luaL_checknumber( L, 5);
+    DWORD cf = ( DWORD) luaL_checknumber( L, 6);
+    const char *cd = lua_tostring( L, 8);
+
+    psa.nLength = sizeof( psa);
+    psa.lpSecurityDescriptor = NULL;
+    psa.bInheritHandle = FALSE;
+    if( lua_istable( L, 3)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 3);
+        if( !lua_isnil( L, -1))
+            psa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 3);
+    }
+
+    tsa.nLength = sizeof( tsa);
+    tsa.lpSecurityDescriptor = NULL;
+    tsa.bInheritHandle = FALSE;
+    if( lua_istable( L, 4)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 4);
+        if( !lua_isnil( L, -1))
+            tsa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 4);
+    }
+
+    env = NULL;
+
+    memset( &si, 0, sizeof( si));
+    si.cb = sizeof( si);
+    if( lua_istable(L, 7)) {
+        lua_pushnil(L);
+        while( lua_next(L, 7) != 0) {
+            const char *key = luaL_checkstring( L, -2);
+            if( !strcmp( key, "lpDesktop")) {
+                si.lpDesktop = _strdup( luaL_checkstring( L, -1));
+            } else if( !strcmp( key, "lpTitle")) {
+                si.lpTitle = _strdup( luaL_checkstring( L, -1));
+            } else if( !strcmp( key, "dwX")) {
+                si.dwX = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwY")) {
+                si.dwY = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwXSize")) {
+                si.dwXSize = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwYSize")) {
+                si.dwYSize = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwXCountChars")) {
+                si.dwXCountChars = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwYCountChars")) {
+                si.dwYCountChars = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwFillAttribute")) {
+                si.dwFillAttribute = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "dwFlags")) {
+                si.dwFlags = ( DWORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "wShowWindow")) {
+                si.wShowWindow = ( WORD) luaL_checknumber( L, -1);
+            } else if( !strcmp( key, "hStdInput")) {
+                si.hStdInput = CheckHandle( L, -1);
+            } else if( !strcmp( key, "hStdOutput")) {
+                si.hStdOutput = CheckHandle( L, -1);
+            } else if( !strcmp( key, "hStdError")) {
+                si.hStdError = CheckHandle( L, -1);
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+
+    brc = CreateProcess( an, ( char *) cl, &psa, &tsa, ih, cf, env, cd, &si, &pi);
+
+    if( si.lpDesktop != NULL)
+        free( si.lpDesktop);
+    if( si.lpTitle != NULL)
+        free( si.lpTitle);
+
+    lua_pushnumber( L, brc);
+    if( brc) {
+        PushHandle( L, pi.hProcess, HANDLE_KERNEL, "process");
+        PushHandle( L, pi.hThread, HANDLE_KERNEL, "thread");
+        lua_pushnumber( L, pi.dwProcessId);
+        lua_pushnumber( L, pi.dwThreadId);
+    } else {
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+        lua_pushnil( L);
+    }
+
+    return( 5);
+}
+
+/****if* luaw32/global_GetTempFileName
+* NAME
+*  global_GetTempFileName
+* FUNCTION
+*  Win32 GetTempFileName.
+* INPUTS
+*  L: Lua state
+*  stack[1]: specifies the directory path for the file name
+*  stack[2]: Specifies the type of access to the object
+*  stack[3]: Specifies an unsigned integer that the function
+*            converts to a hexadecimal string for use in creating
+*            the temporary file name
+* RESULT
+*  stack[1]: Unique numeric value or 0 if error
+*  stack[2]: Temporary file name or nil if error
+* SOURCE
+*/
+
+static int global_GetTempFileName(lua_State *L) {
+    UINT rc;
+    char tfn[MAX_PATH*4];
+    const char *path = luaL_checkstring( L, 1);
+    const char *pfx = luaL_checkstring( L, 2);
+    UINT unique = ( UINT) luaL_checknumber( L, 3);
+
+    rc = GetTempFileName( path, pfx, unique, tfn);
+
+    lua_pushnumber( L, rc);
+    if( rc)
+        lua_pushstring( L, tfn);
+    else
+        lua_pushnil( L);
+
+    return( 2);
+}
+/***/
+
+/****if* luaw32/global_GetTempPath
+* NAME
+*  global_GetTempPath
+* FUNCTION
+*  Win32 GetTempPath.
+* INPUTS
+*  L: Lua state
+* RESULT
+*  stack[1]: Unique numeric value or 0 if error
+*  stack[2]: Path of the directory designated for temporary files
+* SOURCE
+*/
+
+static int global_GetTempPath(lua_State *L) {
+    DWORD rc;
+    char tfn[MAX_PATH*4];
+
+    rc = GetTempPath( sizeof(tfn)-1, tfn);
+
+    lua_pushnumber( L, rc);
+    if( rc)
+        lua_pushstring( L, tfn);
+    else
+        lua_pushnil( L);
+
+    return( 2);
+}
+/***/
+
+/****if* luaw32/global_CreateFile
+* NAME
+*  global_CreateFile
+* FUNCTION
+*  Win32 CreateFile.
+* INPUTS
+*  L: Lua state
+*  stack[1]: Name of the object to create or open
+*  stack[2]: Specifies the type of access to the object
+*  stack[3]: Specifies how the object can be shared
+*  stack[4]: Table:
+*            .bInheritHandle: determines whether the returned handle
+*                             can be inherited by child processes
+*  stack[5]: Specifies which action to take on files that exist
+*  stack[6]: Specifies the file attributes and flags for the file
+*  stack[7]: Specifies a handle with GENERIC_READ access to a
+*            template file
+* RESULT
+*  stack[1]: Handle
+* SOURCE
+*/
+
+static int global_CreateFile(lua_State *L) {
+    SECURITY_ATTRIBUTES sa;
+    HANDLE h;
+    const char *name = luaL_checkstring( L, 1);
+    DWORD da = ( DWORD) luaL_checknumber( L, 2);
+    DWORD sm = ( DWORD) luaL_checknumber( L, 3);
+    DWORD cd = ( DWORD) luaL_checknumber( L, 5);
+    DWORD fa = ( DWORD) luaL_checknumber( L, 6);
+    HANDLE th = NULL;
+
+    sa.nLength = sizeof( sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = FALSE;
+    if( lua_istable( L, 4)) {
+        lua_pushstring( L, "bInheritHandle");
+        lua_gettable( L, 4);
+        if( !lua_isnil( L, -1))
+            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
+        lua_pop( L, 1);
+    }
+    if( !lua_isnoneornil( L, 7))
+        th = CheckHandle( L, 7);
+
+    h = CreateFile( name, da, sm, &sa, cd, fa, th);
+
+    if( h != INVALID_HANDLE_VALUE)
+        PushHandle( L, h, HANDLE_KERNEL, "file");
+    else
+        lua_pushnumber( L, ( long) h);
+
+    return( 1);
+}
+/***/
+
+/****if* luaw32/global_ReadFile
+* NAME
+*  global_ReadFile
+* FUNCTION
+*  Win32 ReadFile.
+* INPUTS
+*  L: Lua state
+*  stack[1]: Handle to the file to be read
+*  stack[2]: Specifies the number of bytes to be read from the file
+* RESULT
+*  stack[1]: True if ok.
+*  stack[2]: Buffer read or nil if error
+* SOURCE
+*/
+
+static int global_ReadFile(lua_State *L) {
+    DWORD bread;
+    char *buf;
+    BOOL brc = FALSE;
+    HANDLE h = CheckHandle( L, 1);
+    DWORD btoread = ( DWORD) luaL_checknumber( L, 2);
+
+    buf = malloc( btoread);
+    if( buf != NULL) {
+        brc = ReadFile( ( HANDLE) h, buf, btoread, &bread, NULL);
+        lua_pushboolean( L, TRUE);
+        lua_pushlstring( L, buf, bread);
+        free( buf);
+    } else {
+        lua_pushboolean( L, FALSE);
+        lua_pushnil( L);
+    }
+
+    return( 2);
+}
+/***/
+
+/****if* luaw32/global_WriteFile
+* NAME
+*  global_WriteFile
+* FUNCTION
+*  Win32 WriteFile.
+* INPUTS
+*  L: Lua state
+*  stack[1]: Handle to the file to be written to
+*  stack[2]: Buffer containing the data to be written to the file
+* RESULT
+*  stack[1]: True if ok.
+*  stack[2]: Number of bytes written or nil if error
+* SOURCE
+*/
+
+static int global_WriteFile(lua_State *L) {
+    DWORD bwrite;
+    DWORD btowrite;
+    BOOL brc;
+    HANDLE h = CheckHandle( L, 1);
+    const char *buf = luaL_checklstring( L, 2, &btowrite);
+
+    brc = WriteFile( ( HANDLE) h, buf, btowrite, &bwrite, NULL);
+    lua_pushboolean( L, brc);
+    if( brc)
+        lua_pushnumber( L, bwrite);
+    else
+        lua_pushnil( L);
+
+    return( 2);
+}
+/***/
+
+static int global_WaitForSingleObject(lua_State *L) {
+    HANDLE h = CheckHandle( L, 1);
+    DWORD t = ( DWORD) luaL_checknumber( L, 2);
+
+    lua_pushnumber( L, WaitForSingleObject( ( HANDLE) h, t));
+
+    return( 1);
+}
+
+static int global_WaitForMultipleObjects(lua_State *L) {
+    HANDLE ha[64];
+    DWORD c = 0;
+    BOOL wa = ( BOOL) luaL_checknumber( L, 2);
+    DWORD t = ( DWORD) luaL_checknumber( L, 3);
+
+    if( lua_istable( L, 1)) {
+        for( ;c < 64; c++) {
+            lua_pushnumber( L, c + 1);
+            lua_gettable( L, 1);
+            if( lua_isnil( L, -1))
+                break;
+            ha[c] = CheckHandle( L, -1);
+            lua_pop( L, 1);
+        }
+    }
+
+    lua_pushnumber( L, WaitForMultipleObjects( c, ha, wa, t));
+
+    return( 1);
+}
+
+/* Waits on any number of handles. Up to MAXIMUM_WAIT_OBJECTS WaitForMultipleObjects is
+   used as is, beyond that WaitAny registers thread pool waits and WaitAll waits group
+   by group. Thread pool waits acquire the objects they see signaled, so beyond the limit
+   WaitAny is meant for processes, threads and manual-reset events; not for mutexes */
+
+// reads array of handles at idx into a userdata left on the stack
+static HANDLE *CheckHandleArray(lua_State *L, int idx, int *count) {
+	HANDLE *ha;
+	int n, i;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = (int)lua_rawlen(L, idx);
+	ha = (HANDLE *)lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(HANDLE));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, idx, i + 1);
+		ha[i] = CheckHandle(L, -1);
+		lua_pop(L, 1);
+	}
+	*count = n;
+
+	return ha;
+}
+
+static DWORD CheckWaitTimeout(lua_State *L, int n) {
+	const lua_Integer t = luaL_optinteger(L, n, -1);
+	return t < 0 ? INFINITE : (DWORD)t;
+}
+
+// Lua:  returns nil, "timeout" or nil, "error", GetLastError() of the failed wait
+static int PushWaitFailure(lua_State *L, BOOL timedOut) {
+	lua_pushnil(L);
+	if (timedOut) {
+		lua_pushstring(L, "timeout");
+		return 2;
+	}
+	lua_pushstring(L, "error");
+	lua_pushinteger(L, GetLastError());
+	return 3;
+}
+
+// returns 1-based index of a signaled handle among the first n, 0 - none
+static int PollHandles(const HANDLE *ha, int n) {
+	int i;
+
+	for (i = 0; i < n; i += MAXIMUM_WAIT_OBJECTS) {
+		const DWORD c = n - i < MAXIMUM_WAIT_OBJECTS ? n - i : MAXIMUM_WAIT_OBJECTS;
+		const DWORD rc = WaitForMultipleObjects(c, ha + i, FALSE, 0);
+		if (rc < WAIT_OBJECT_0 + c)
+			return i + (rc - WAIT_OBJECT_0) + 1;
+		if (rc >= WAIT_ABANDONED_0 && rc < WAIT_ABANDONED_0 + c)
+			return i + (rc - WAIT_ABANDONED_0) + 1;
+	}
+
+	return 0;
+}
+
+struct S_WAITANY {
+	volatile LONG fired;    // 1-based index of the first signaled handle
+	HANDLE done;
+};
+
+struct S_WAITITEM {
+	struct S_WAITANY *w;
+	LONG index;
+	HANDLE wait;
+};
+
+static VOID CALLBACK WaitAnyCallback(PVOID param, BOOLEAN timedOut) {
+	const struct S_WAITITEM *item = (const struct S_WAITITEM *)param;
+
+	if (InterlockedCompareExchange(&item->w->fired, item->index, 0) == 0)
+		SetEvent(item->w->done);
+}
+
+// Lua:  WaitAny({h1, h2, ...}, timeoutMs), timeoutMs = nil or -1 - infinite
+//       returns 1-based index and the handle that fired or nil, "timeout" | "error", code
+static int global_WaitAny(lua_State *L) {
+	const DWORD timeout = CheckWaitTimeout(L, 2);
+	struct S_WAITITEM *items;
+	struct S_WAITANY w;
+	HANDLE *ha;
+	int n, i, index = 0;
+	BOOL failed = FALSE;
+	DWORD err;
+
+	ha = CheckHandleArray(L, 1, &n);
+	if (n == 0)
+		return luaL_argerror(L, 1, "handles expected");
+
+	if (n <= MAXIMUM_WAIT_OBJECTS) {
+		const DWORD rc = WaitForMultipleObjects(n, ha, FALSE, timeout);
+		if (rc < WAIT_OBJECT_0 + n)
+			index = rc - WAIT_OBJECT_0 + 1;
+		else if (rc >= WAIT_ABANDONED_0 && rc < WAIT_ABANDONED_0 + n)
+			index = rc - WAIT_ABANDONED_0 + 1;
+		else
+			failed = rc != WAIT_TIMEOUT;
+	}
+	else if ((index = PollHandles(ha, n)) == 0 && timeout != 0) {
+		items = (struct S_WAITITEM *)lua_newuserdata(L, n * sizeof(*items));
+		w.fired = 0;
+		w.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		failed = w.done == NULL;
+		for (i = 0; i < n && !failed; i++) {
+			items[i].w = &w;
+			items[i].index = i + 1;
+			items[i].wait = NULL;
+			failed = !RegisterWaitForSingleObject(&items[i].wait, ha[i], WaitAnyCallback, &items[i],
+			                                      INFINITE, WT_EXECUTEONLYONCE);
+		}
+		if (!failed)
+			WaitForSingleObject(w.done, timeout);
+		err = GetLastError();
+		// INVALID_HANDLE_VALUE waits for running callbacks, none is left behind
+		while (--i >= 0)
+			if (items[i].wait != NULL)
+				UnregisterWaitEx(items[i].wait, INVALID_HANDLE_VALUE);
+		if (w.done != NULL)
+			CloseHandle(w.done);
+		SetLastError(err);      // reported by PushWaitFailure
+		index = failed ? 0 : w.fired;
+	}
+
+	if (index == 0)
+		return PushWaitFailure(L, !failed);
+
+	lua_pushinteger(L, index);
+	lua_rawgeti(L, 1, index);
+
+	return 2;
+}
+
+// Lua:  WaitAll({h1, h2, ...}, timeoutMs), timeoutMs = nil or -1 - infinite
+//       returns true or nil, "timeout" | "error", code
+//       up to MAXIMUM_WAIT_OBJECTS (64) handles the wait is atomic. Beyond that the
+//       groups of 64 are waited one after another: the wait is not atomic, and
+//       auto-reset events, semaphores and mutexes acquired by earlier groups stay
+//       acquired when a later group times out or fails
+static int global_WaitAll(lua_State *L) {
+	const DWORD timeout = CheckWaitTimeout(L, 2);
+	const DWORD start = GetTickCount();
+	HANDLE *ha;
+	int n, i;
+
+	ha = CheckHandleArray(L, 1, &n);
+	for (i = 0; i < n; i += MAXIMUM_WAIT_OBJECTS) {
+		const DWORD c = n - i < MAXIMUM_WAIT_OBJECTS ? n - i : MAXIMUM_WAIT_OBJECTS;
+		const DWORD left = timeout == INFINITE ? INFINITE : RemainingTimeout(timeout, start);
+		const DWORD rc = WaitForMultipleObjects(c, ha + i, TRUE, left);
+		if (rc == WAIT_TIMEOUT)
+			return PushWaitFailure(L, TRUE);
+		if (rc >= WAIT_OBJECT_0 + c && !(rc >= WAIT_ABANDONED_0 && rc < WAIT_ABANDONED_0 + c))
+			return PushWaitFailure(L, FALSE);
+	}
+	lua_pushboolean(L, 1);
+
+	return 1;
+}
+
+/* In-process locks: uncontended acquire and release stay in user mode.
+   The objects live in userdata, which never moves, and are shared between
+   the callback thread and main() of a script through the same Lua state */
+
+#define SRWLOCK_MT      "w32.SRWLock"
+#define CRITSEC_MT      "w32.CriticalSection"
+#define CONDVAR_MT      "w32.ConditionVariable"
+#define LOCKGUARD_MT    "w32.LockGuard"
+
+// releasing a lock that is not held raises STATUS_RESOURCE_NOT_OWNED and takes
+// the whole terminal down, so holders are recorded and checked before release
+#define SRW_SHARED_MAX  16
+
+struct S_SRWSHARED {
+	volatile LONG tid;      // thread holding or waiting for the lock in shared mode, 0 - free slot
+	volatile LONG count;    // shared acquisitions of that thread
+};
+
+struct S_SRWLOCK {
+	SRWLOCK lock;
+	volatile DWORD owner;   // thread holding it exclusively, 0 - none
+	struct S_SRWSHARED shared[SRW_SHARED_MAX];
+};
+
+struct S_CRITSEC {
+	CRITICAL_SECTION cs;
+	DWORD owner;            // 0 - none, written by the owner only
+	int depth;              // recursion depth of the owner
+};
+
+static void LockExclusive(lua_State *L, struct S_SRWLOCK *l) {
+	const DWORD tid = GetCurrentThreadId();
+
+	if (l->owner == tid)
+		luaL_error(L, "SRWLock is already held by this thread");
+	AcquireSRWLockExclusive(&l->lock);
+	l->owner = tid;
+}
+
+static void UnlockExclusive(struct S_SRWLOCK *l) {
+	l->owner = 0;
+	ReleaseSRWLockExclusive(&l->lock);
+}
+
+// slot of thread tid among the shared holders or NULL
+static struct S_SRWSHARED *FindSharedHolder(struct S_SRWLOCK *l, DWORD tid) {
+	int i;
+
+	for (i = 0; i < SRW_SHARED_MAX; i++)
+		if (l->shared[i].tid == (LONG)tid)
+			return &l->shared[i];
+
+	return NULL;
+}
+
+// slot of the calling thread, a free one is claimed; raises an error when all are taken
+static struct S_SRWSHARED *ClaimSharedHolder(lua_State *L, struct S_SRWLOCK *l) {
+	const DWORD tid = GetCurrentThreadId();
+	struct S_SRWSHARED *h = FindSharedHolder(l, tid);
+	int i;
+
+	if (l->owner == tid)
+		luaL_error(L, "SRWLock is already held exclusively by this thread");
+	for (i = 0; h == NULL && i < SRW_SHARED_MAX; i++)
+		if (InterlockedCompareExchange(&l->shared[i].tid, (LONG)tid, 0) == 0)
+			h = &l->shared[i];
+	if (h == NULL)
+		luaL_error(L, "SRWLock has more than %d shared holders", SRW_SHARED_MAX);
+
+	return h;
+}
+
+// frees the slot when the thread neither holds nor acquires the lock in shared mode
+static void DropSharedHolder(struct S_SRWSHARED *h) {
+	if (h->count == 0)
+		InterlockedExchange(&h->tid, 0);
+}
+
+static void LockShared(lua_State *L, struct S_SRWLOCK *l) {
+	struct S_SRWSHARED *h = ClaimSharedHolder(L, l);
+
+	AcquireSRWLockShared(&l->lock);
+	InterlockedIncrement(&h->count);
+}
+
+// returns FALSE when thread tid does not hold the lock in shared mode
+static BOOL UnlockShared(struct S_SRWLOCK *l, DWORD tid) {
+	struct S_SRWSHARED *h = FindSharedHolder(l, tid);
+
+	if (h == NULL || h->count <= 0)
+		return FALSE;
+	InterlockedDecrement(&h->count);
+	DropSharedHolder(h);
+	ReleaseSRWLockShared(&l->lock);
+	return TRUE;
+}
+
+static void EnterCritSec(struct S_CRITSEC *c) {
+	EnterCriticalSection(&c->cs);
+	c->owner = GetCurrentThreadId();
+	c->depth++;
+}
+
+// returns FALSE when the calling thread does not own the critical section
+static BOOL LeaveCritSec(struct S_CRITSEC *c) {
+	if (c->owner != GetCurrentThreadId())
+		return FALSE;
+	if (--c->depth == 0)
+		c->owner = 0;
+	LeaveCriticalSection(&c->cs);
+	return TRUE;
+}
+
+/* Lock guard: releases the lock taken by lock:guard() on release(), __close (Lua 5.4
+   <close>) or __gc, so an error between acquire and release does not leave it held */
+
+#define GUARD_EXCLUSIVE 0
+#define GUARD_SHARED    1
+#define GUARD_CRITSEC   2
+
+struct S_LOCKGUARD {
+	void *lock;             // NULL - released
+	int mode;
+	int ref;                // registry reference keeping the lock userdata alive
+	DWORD tid;              // thread that acquired it, __gc may run on another one
+};
+
+// the lock userdata is at index 1 and already acquired in mode
+static int PushLockGuard(lua_State *L, void *lock, int mode) {
+	struct S_LOCKGUARD *g = (struct S_LOCKGUARD *)lua_newuserdata(L, sizeof(struct S_LOCKGUARD));
+
+	g->lock = lock;
+	g->mode = mode;
+	g->tid = GetCurrentThreadId();
+	lua_pushvalue(L, 1);
+	g->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	luaL_getmetatable(L, LOCKGUARD_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// an SRWLock is not bound to a thread, a critical section is left only by its owner
+static BOOL ReleaseLockGuard(lua_State *L, struct S_LOCKGUARD *g) {
+	if (g->lock == NULL)
+		return FALSE;
+	switch (g->mode) {
+	case GUARD_EXCLUSIVE:
+		UnlockExclusive((struct S_SRWLOCK *)g->lock);
+		break;
+	case GUARD_SHARED:
+		UnlockShared((struct S_SRWLOCK *)g->lock, g->tid);
+		break;
+	default:
+		if (!LeaveCritSec((struct S_CRITSEC *)g->lock))
+			return FALSE;
+	}
+	g->lock = NULL;
+	luaL_unref(L, LUA_REGISTRYINDEX, g->ref);
+
+	return TRUE;
+}
+
+// Lua:  guard:release(), returns true when the lock was released by this call
+static int lockguard_release(lua_State *L) {
+	struct S_LOCKGUARD *g = (struct S_LOCKGUARD *)luaL_checkudata(L, 1, LOCKGUARD_MT);
+
+	if (g->lock != NULL && g->mode == GUARD_CRITSEC &&
+	    ((struct S_CRITSEC *)g->lock)->owner != GetCurrentThreadId())
+		return luaL_error(L, "CriticalSection is not entered by this thread");
+	lua_pushboolean(L, ReleaseLockGuard(L, g));
+
+	return 1;
+}
+
+// a critical section collected on another thread can not be left and stays entered
+static int lockguard_gc(lua_State *L) {
+	ReleaseLockGuard(L, (struct S_LOCKGUARD *)luaL_checkudata(L, 1, LOCKGUARD_MT));
+	return 0;
+}
+
+static const luaL_Reg lockguard_methods[] = {
+	{"release", lockguard_release},
+	{"__close", lockguard_gc},
+	{"__gc", lockguard_gc},
+	{NULL, NULL}
+};
+
+// Lua:  CreateSRWLock(), up to SRW_SHARED_MAX (16) threads may hold it in shared mode at once
+static int global_CreateSRWLock(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)lua_newuserdata(L, sizeof(struct S_SRWLOCK));
+
+	InitializeSRWLock(&l->lock);
+	l->owner = 0;
+	memset(l->shared, 0, sizeof(l->shared));
+	luaL_getmetatable(L, SRWLOCK_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int srwlock_lock(lua_State *L) {
+	LockExclusive(L, (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT));
+	return 0;
+}
+
+static int srwlock_unlock(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT);
+
+	if (l->owner != GetCurrentThreadId())
+		return luaL_error(L, "SRWLock is not held exclusively by this thread");
+	UnlockExclusive(l);
+
+	return 0;
+}
+
+static int srwlock_lockShared(lua_State *L) {
+	LockShared(L, (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT));
+	return 0;
+}
+
+static int srwlock_unlockShared(lua_State *L) {
+	if (!UnlockShared((struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT), GetCurrentThreadId()))
+		return luaL_error(L, "SRWLock is not held in shared mode by this thread");
+	return 0;
+}
+
+static int srwlock_tryLock(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT);
+	const DWORD tid = GetCurrentThreadId();
+	const BOOL rc = l->owner != tid && TryAcquireSRWLockExclusive(&l->lock);
+
+	if (rc)
+		l->owner = tid;
+	lua_pushboolean(L, rc);
+
+	return 1;
+}
+
+static int srwlock_tryLockShared(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT);
+	struct S_SRWSHARED *h;
+	BOOL rc;
+
+	if (l->owner == GetCurrentThreadId()) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	h = ClaimSharedHolder(L, l);
+	rc = TryAcquireSRWLockShared(&l->lock);
+	if (rc)
+		InterlockedIncrement(&h->count);
+	else
+		DropSharedHolder(h);
+	lua_pushboolean(L, rc);
+
+	return 1;
+}
+
+// Lua:  local g <close> = lock:guard(), takes the lock exclusively and returns w32.LockGuard
+static int srwlock_guard(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT);
+
+	LockExclusive(L, l);
+	return PushLockGuard(L, l, GUARD_EXCLUSIVE);
+}
+
+// Lua:  local g <close> = lock:guardShared()
+static int srwlock_guardShared(lua_State *L) {
+	struct S_SRWLOCK *l = (struct S_SRWLOCK *)luaL_checkudata(L, 1, SRWLOCK_MT);
+
+	LockShared(L, l);
+	return PushLockGuard(L, l, GUARD_SHARED);
+}
+
+static const luaL_Reg srwlock_methods[] = {
+	{"lock", srwlock_lock},
+	{"unlock", srwlock_unlock},
+	{"lockShared", srwlock_lockShared},
+	{"unlockShared", srwlock_unlockShared},
+	{"tryLock", srwlock_tryLock},
+	{"tryLockShared", srwlock_tryLockShared},
+	{"guard", srwlock_guard},
+	{"guardShared", srwlock_guardShared},
+	{NULL, NULL}
+};
+
+// Lua:  CreateCriticalSection(spinCount), spinCount = nil - 4000
+static int global_CreateCriticalSection(lua_State *L) {
+	const DWORD spin = (DWORD)luaL_optinteger(L, 1, 4000);
+	struct S_CRITSEC *c = (struct S_CRITSEC *)lua_newuserdata(L, sizeof(struct S_CRITSEC));
+
+	InitializeCriticalSectionAndSpinCount(&c->cs, spin);
+	c->owner = 0;
+	c->depth = 0;
+	luaL_getmetatable(L, CRITSEC_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int critsec_enter(lua_State *L) {
+	EnterCritSec((struct S_CRITSEC *)luaL_checkudata(L, 1, CRITSEC_MT));
+	return 0;
+}
+
+static int critsec_leave(lua_State *L) {
+	if (!LeaveCritSec((struct S_CRITSEC *)luaL_checkudata(L, 1, CRITSEC_MT)))
+		return luaL_error(L, "CriticalSection is not entered by this thread");
+	return 0;
+}
+
+static int critsec_tryEnter(lua_State *L) {
+	struct S_CRITSEC *c = (struct S_CRITSEC *)luaL_checkudata(L, 1, CRITSEC_MT);
+	const BOOL rc = TryEnterCriticalSection(&c->cs);
+
+	if (rc) {
+		c->owner = GetCurrentThreadId();
+		c->depth++;
+	}
+	lua_pushboolean(L, rc);
+
+	return 1;
+}
+
+// Lua:  local g <close> = cs:guard(), enters and returns w32.LockGuard
+static int critsec_guard(lua_State *L) {
+	struct S_CRITSEC *c = (struct S_CRITSEC *)luaL_checkudata(L, 1, CRITSEC_MT);
+
+	EnterCritSec(c);
+	return PushLockGuard(L, c, GUARD_CRITSEC);
+}
+
+static int critsec_gc(lua_State *L) {
+	DeleteCriticalSection(&((struct S_CRITSEC *)luaL_checkudata(L, 1, CRITSEC_MT))->cs);
+	return 0;
+}
+
+static const luaL_Reg critsec_methods[] = {
+	{"enter", critsec_enter},
+	{"leave", critsec_leave},
+	{"tryEnter", critsec_tryEnter},
+	{"guard", critsec_guard},
+	{"__gc", critsec_gc},
+	{NULL, NULL}
+};
+
+// Lua:  CreateConditionVariable()
+static int global_CreateConditionVariable(lua_State *L) {
+	CONDITION_VARIABLE *cv = (CONDITION_VARIABLE *)lua_newuserdata(L, sizeof(CONDITION_VARIABLE));
+
+	InitializeConditionVariable(cv);
+	luaL_getmetatable(L, CONDVAR_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// Lua:  cv:wait(lock, timeoutMs, shared), lock is w32.SRWLock or w32.CriticalSection held by the caller
+//       shared - the SRWLock is held in shared mode; a critical section must be entered once
+//       returns false on timeout, the lock is held again in both cases
+static int condvar_wait(lua_State *L) {
+	CONDITION_VARIABLE *cv = (CONDITION_VARIABLE *)luaL_checkudata(L, 1, CONDVAR_MT);
+	const DWORD timeout = CheckWaitTimeout(L, 3);
+	const DWORD tid = GetCurrentThreadId();
+	struct S_SRWLOCK *srw = (struct S_SRWLOCK *)TestUdata(L, 2, SRWLOCK_MT);
+	BOOL rc;
+
+	if (srw != NULL) {
+		const BOOL shared = lua_toboolean(L, 4);
+		const struct S_SRWSHARED *h = FindSharedHolder(srw, tid);
+		// a shared holder keeps its slot and count over the wait, no other thread can use them
+		if (shared ? h == NULL || h->count <= 0 : srw->owner != tid)
+			return luaL_error(L, shared ? "SRWLock is not held in shared mode by this thread" :
+			                              "SRWLock is not held exclusively by this thread");
+		if (!shared)
+			srw->owner = 0;
+		rc = SleepConditionVariableSRW(cv, &srw->lock, timeout,
+		                               shared ? CONDITION_VARIABLE_LOCKMODE_SHARED : 0);
+		if (!shared)
+			srw->owner = tid;
+	}
+	else {
+		struct S_CRITSEC *c = (struct S_CRITSEC *)luaL_checkudata(L, 2, CRITSEC_MT);
+		if (c->owner != tid || c->depth != 1)
+			return luaL_error(L, "CriticalSection must be entered once by this thread");
+		c->owner = 0;
+		c->depth = 0;
+		rc = SleepConditionVariableCS(cv, &c->cs, timeout);
+		c->owner = tid;
+		c->depth = 1;
+	}
+	lua_pushboolean(L, rc);
+
+	return 1;
+}
+
+static int condvar_wake(lua_State *L) {
+	WakeConditionVariable((CONDITION_VARIABLE *)luaL_checkudata(L, 1, CONDVAR_MT));
+	return 0;
+}
+
+static int condvar_wakeAll(lua_State *L) {
+	WakeAllConditionVariable((CONDITION_VARIABLE *)luaL_checkudata(L, 1, CONDVAR_MT));
+	return 0;
+}
+
+static const luaL_Reg condvar_methods[] = {
+	{"wait", condvar_wait},
+	{"wake", condvar_wake},
+	{"wakeAll", condvar_wakeAll},
+	{NULL, NULL}
+};
+
+/* Named shared memory: pagefile-backed file mappings */
+
+#define SHMEM_MT        "w32.SharedMemory"
+
+struct S_SHMEM {
+	HANDLE mapping;
+	char *view;             // NULL when closed
+	size_t size;
+	BOOL existed;           // the mapping had already been created
+};
+
+// creates (size > 0) or opens (size == 0) the named mapping and maps all of it
+static BOOL MapSharedMemory(const char *name, size_t size, struct S_SHMEM *m) {
+	MEMORY_BASIC_INFORMATION mbi;
+
+	m->view = NULL;
+	if (size > 0)
+		m->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		                               (DWORD)((unsigned long long)size >> 32), (DWORD)size, name);
+	else
+		m->mapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (m->mapping == NULL)
+		return FALSE;
+	m->existed = size == 0 || GetLastError() == ERROR_ALREADY_EXISTS;
+
+	m->view = (char *)MapViewOfFile(m->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (m->view == NULL || !VirtualQuery(m->view, &mbi, sizeof(mbi))) {
+		if (m->view != NULL)
+			UnmapViewOfFile(m->view);
+		CloseHandle(m->mapping);
+		m->view = NULL;
+		return FALSE;
+	}
+	// an existing mapping may be bigger than requested, the view is rounded up to pages
+	m->size = size > 0 && size < mbi.RegionSize ? size : mbi.RegionSize;
+
+	return TRUE;
+}
+
+static void UnmapSharedMemory(struct S_SHMEM *m) {
+	if (m->view != NULL) {
+		UnmapViewOfFile(m->view);
+		CloseHandle(m->mapping);
+		m->view = NULL;
+	}
+}
+
+static int PushSharedMemory(lua_State *L, const char *name, size_t size) {
+	struct S_SHMEM *m = (struct S_SHMEM *)lua_newuserdata(L, sizeof(*m));
+
+	if (!MapSharedMemory(name, size, m)) {
+		lua_pushnil(L);
+		lua_pushinteger(L, GetLastError());
+		return 2;
+	}
+	luaL_getmetatable(L, SHMEM_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// Lua:  CreateSharedMemory(name, size), returns w32.SharedMemory or nil, error code
+static int global_CreateSharedMemory(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	const lua_Integer size = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, size > 0, 2, "positive size expected");
+
+	return PushSharedMemory(L, name, (size_t)size);
+}
+
+// Lua:  OpenSharedMemory(name), returns w32.SharedMemory or nil, error code
+static int global_OpenSharedMemory(lua_State *L) {
+	return PushSharedMemory(L, luaL_checkstring(L, 1), 0);
+}
+
+// checks that [offset, offset + len) is inside the view, returns pointer to offset
+static char *CheckSharedRange(lua_State *L, int n, size_t len) {
+	struct S_SHMEM *m = (struct S_SHMEM *)luaL_checkudata(L, 1, SHMEM_MT);
+	const lua_Integer offset = luaL_checkinteger(L, n);
+
+	if (m->view == NULL)
+		luaL_error(L, "shared memory is closed");
+	luaL_argcheck(L, offset >= 0 && (size_t)offset <= m->size && len <= m->size - (size_t)offset,
+	              n, "out of shared memory bounds");
+
+	return m->view + offset;
+}
+
+static int shmem_getI32(lua_State *L) {
+	INT32 v;
+	memcpy(&v, CheckSharedRange(L, 2, sizeof(v)), sizeof(v));
+	lua_pushinteger(L, v);
+	return 1;
+}
+
+static int shmem_setI32(lua_State *L) {
+	const INT32 v = (INT32)luaL_checkinteger(L, 3);
+	memcpy(CheckSharedRange(L, 2, sizeof(v)), &v, sizeof(v));
+	return 0;
+}
+
+static int shmem_getI64(lua_State *L) {
+	INT64 v;
+	memcpy(&v, CheckSharedRange(L, 2, sizeof(v)), sizeof(v));
+	lua_pushint64(L, v);
+	return 1;
+}
+
+static int shmem_setI64(lua_State *L) {
+	const INT64 v = (INT64)lua_checkint64(L, 3);
+	memcpy(CheckSharedRange(L, 2, sizeof(v)), &v, sizeof(v));
+	return 0;
+}
+
+static int shmem_getF64(lua_State *L) {
+	double v;
+	memcpy(&v, CheckSharedRange(L, 2, sizeof(v)), sizeof(v));
+	lua_pushnumber(L, v);
+	return 1;
+}
+
+static int shmem_setF64(lua_State *L) {
+	const double v = (double)luaL_checknumber(L, 3);
+	memcpy(CheckSharedRange(L, 2, sizeof(v)), &v, sizeof(v));
+	return 0;
+}
+
+// Lua:  shm:setBytes(offset, s)
+static int shmem_setBytes(lua_State *L) {
+	size_t len;
+	const char *s = luaL_checklstring(L, 3, &len);
+	memcpy(CheckSharedRange(L, 2, len), s, len);
+	return 0;
+}
+
+// Lua:  shm:sub(offset, len), the string is built straight from the view
+static int shmem_sub(lua_State *L) {
+	const size_t len = (size_t)luaL_checkinteger(L, 3);
+	lua_pushlstring(L, CheckSharedRange(L, 2, len), len);
+	return 1;
+}
+
+static int shmem_size(lua_State *L) {
+	const struct S_SHMEM *m = (const struct S_SHMEM *)luaL_checkudata(L, 1, SHMEM_MT);
+	lua_pushinteger(L, m->view != NULL ? (lua_Integer)m->size : 0);
+	return 1;
+}
+
+static int shmem_close(lua_State *L) {
+	UnmapSharedMemory((struct S_SHMEM *)luaL_checkudata(L, 1, SHMEM_MT));
+	return 0;
+}
+
+static int shmem_tostring(lua_State *L) {
+	const struct S_SHMEM *m = (const struct S_SHMEM *)luaL_checkudata(L, 1, SHMEM_MT);
+
+	if (m->view != NULL)
+		lua_pushfstring(L, SHMEM_MT ": %p (%d bytes)", (void *)m->view, (int)m->size);
+	else
+		lua_pushliteral(L, SHMEM_MT ": closed");
+
+	return 1;
+}
+
+static const luaL_Reg shmem_methods[] = {
+	{"getI32", shmem_getI32},
+	{"setI32", shmem_setI32},
+	{"getI64", shmem_getI64},
+	{"setI64", shmem_setI64},
+	{"getF64", shmem_getF64},
+	{"setF64", shmem_setF64},
+	{"getBytes", shmem_sub},
+	{"setBytes", shmem_setBytes},
+	{"sub", shmem_sub},
+	{"size", shmem_size},
+	{"close", shmem_close},
+	{"__gc", shmem_close},
+	{"__tostring", shmem_tostring},
+	{NULL, NULL}
+};
+
+/* Single-producer/single-consumer byte ring in shared memory for external readers.
+   Record: DWORD length, data padded to 8 bytes; RING_WRAP fills the rest of the ring.
+   head and tail are ever growing 32-bit offsets on their own cache lines: the producer
+   publishes tail with release, the consumer publishes head with release.
+   Plain volatile accesses are acquire/release with MSVC on x86 and x64 (/volatile:ms) */
+
+#define RINGBUFFER_MT   "w32.RingBuffer"
+#define RING_MAGIC      0x4252574C      // "LWRB"
+#define RING_WRAP       0xFFFFFFFF
+#define RING_ALIGN(n)   (((n) + 7) & ~(DWORD)7)
+#define RING_EVENT_FMT  "%s.event"
+
+struct S_RINGHDR {
+	DWORD magic;
+	DWORD capacity;         // power of 2
+	char pad0[56];
+	volatile LONG head;     // consumer
+	char pad1[60];
+	volatile LONG tail;     // producer
+	char pad2[60];
+	volatile LONG waiting;  // consumer sleeps on the event
+	char pad3[60];
+};
+
+struct S_RINGBUFFER {
+	struct S_SHMEM shm;
+	struct S_RINGHDR *hdr;
+	char *data;
+	DWORD capacity;         // checked copy of hdr->capacity
+	HANDLE event;           // NULL - no event
+};
+
+// a record takes at most half of the ring, so it fits after a wrap when the ring is empty
+#define RING_MINCAPACITY            64
+#define RING_FITS(capacity, len)    ((len) <= (capacity) / 2 - 11)   // 4 + RING_ALIGN(len) <= capacity / 2
+
+static struct S_RINGBUFFER *CheckRing(lua_State *L) {
+	struct S_RINGBUFFER *rb = (struct S_RINGBUFFER *)luaL_checkudata(L, 1, RINGBUFFER_MT);
+
+	if (rb->shm.view == NULL)
+		luaL_error(L, "ring buffer is closed");
+
+	return rb;
+}
+
+// create: capacity > 0; open: capacity == 0
+static int OpenRing(lua_State *L, const char *name, DWORD capacity, BOOL useEvent) {
+	struct S_RINGBUFFER *rb = (struct S_RINGBUFFER *)lua_newuserdata(L, sizeof(*rb));
+	const char *ename;
+	BOOL existed;
+
+	memset(rb, 0, sizeof(*rb));
+	if (!MapSharedMemory(name, capacity ? sizeof(struct S_RINGHDR) + capacity : 0, &rb->shm)) {
+		lua_pushnil(L);
+		lua_pushinteger(L, GetLastError());
+		return 2;
+	}
+	existed = rb->shm.existed;
+	luaL_getmetatable(L, RINGBUFFER_MT);
+	lua_setmetatable(L, -2);
+	rb->hdr = (struct S_RINGHDR *)rb->shm.view;
+	rb->data = rb->shm.view + sizeof(struct S_RINGHDR);
+
+	if (capacity && !(existed && rb->hdr->magic == RING_MAGIC)) {
+		rb->hdr->capacity = capacity;
+		rb->hdr->head = rb->hdr->tail = rb->hdr->waiting = 0;
+		InterlockedExchange((volatile LONG *)&rb->hdr->magic, RING_MAGIC);
+	}
+	// the header may come from another process: the capacity is checked once and kept
+	rb->capacity = rb->hdr->capacity;
+	if (rb->hdr->magic != RING_MAGIC || rb->capacity < RING_MINCAPACITY || (rb->capacity & (rb->capacity - 1)) != 0 ||
+	    rb->shm.size < sizeof(struct S_RINGHDR) + rb->capacity) {
+		UnmapSharedMemory(&rb->shm);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a ring buffer");
+		return 2;
+	}
+
+	ename = lua_pushfstring(L, RING_EVENT_FMT, name);
+	if (useEvent)
+		rb->event = CreateEvent(NULL, FALSE, FALSE, ename);
+	else if (!capacity)
+		rb->event = OpenEvent(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, ename);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+// Lua:  RingBuffer.create(name, capacity, withEvent)
+//       capacity is rounded up to a power of 2; withEvent creates auto-reset event "<name>.event"
+//       returns w32.RingBuffer or nil, error
+static int ring_create(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	const lua_Integer size = luaL_checkinteger(L, 2);
+	DWORD capacity = 4096;
+
+	luaL_argcheck(L, size > 0 && size <= 0x40000000, 2, "capacity out of range");
+	while (capacity < (DWORD)size)
+		capacity <<= 1;
+
+	return OpenRing(L, name, capacity, lua_toboolean(L, 3));
+}
+
+// Lua:  RingBuffer.open(name), the event is used when the creator made it
+static int ring_open(lua_State *L) {
+	return OpenRing(L, luaL_checkstring(L, 1), 0, FALSE);
+}
+
+// appends one record, returns FALSE when it does not fit now
+static BOOL RingPut(struct S_RINGBUFFER *rb, LONG head, LONG *tail, const char *s, DWORD len) {
+	const DWORD capacity = rb->capacity;
+	const DWORD need = 4 + RING_ALIGN(len);
+	DWORD pos = (DWORD)*tail & (capacity - 1);
+	const DWORD waste = pos + need > capacity ? capacity - pos : 0;
+
+	if ((DWORD)(*tail - head) + waste + need > capacity)
+		return FALSE;
+	if (waste) {
+		*(DWORD *)(rb->data + pos) = RING_WRAP;
+		pos = 0;
+	}
+	*(DWORD *)(rb->data + pos) = len;
+	memcpy(rb->data + pos + 4, s, len);
+	*tail += waste + need;
+
+	return TRUE;
+}
+
+// Lua:  ring:push(s | {s1, s2, ...}), producer side
+//       returns number of records written, stops at the first one that does not fit now;
+//       a record longer than half of the capacity never fits and raises an error
+static int ring_push(lua_State *L) {
+	struct S_RINGBUFFER *rb = CheckRing(L);
+	const LONG head = rb->hdr->head;
+	LONG tail = rb->hdr->tail;
+	const char *s;
+	size_t len;
+	int n = 0, count, i;
+
+	if (lua_istable(L, 2)) {
+		count = (int)lua_rawlen(L, 2);
+		for (i = 1; i <= count; i++) {
+			lua_rawgeti(L, 2, i);
+			s = lua_tolstring(L, -1, &len);
+			lua_pop(L, 1);  // the table keeps the string alive
+			if (s == NULL)
+				return luaL_argerror(L, 2, "array of strings expected");
+			if (!RING_FITS(rb->capacity, len))
+				return luaL_argerror(L, 2, "record larger than half of the ring");
+			if (!RingPut(rb, head, &tail, s, (DWORD)len))
+				break;
+			n++;
+		}
+	}
+	else {
+		s = luaL_checklstring(L, 2, &len);
+		luaL_argcheck(L, RING_FITS(rb->capacity, len), 2, "record larger than half of the ring");
+		n = RingPut(rb, head, &tail, s, (DWORD)len);
+	}
+
+	if (n > 0) {
+		rb->hdr->tail = tail;   // release: the records are visible before the new tail
+		if (rb->event != NULL && InterlockedCompareExchange(&rb->hdr->waiting, 0, 1) == 1)
+			SetEvent(rb->event);
+	}
+	lua_pushinteger(L, n);
+
+	return 1;
+}
+
+// Lua:  ring:pop(max), consumer side, max = nil - all
+//       returns array of records and their number; raises an error when the
+//       producer wrote positions or lengths outside the ring
+static int ring_pop(lua_State *L) {
+	struct S_RINGBUFFER *rb = CheckRing(L);
+	const int max = (int)luaL_optinteger(L, 2, 0);
+	const DWORD capacity = rb->capacity;
+	const LONG tail = rb->hdr->tail;    // acquire: the records before tail are complete
+	LONG head = rb->hdr->head;
+	int n = 0;
+
+	if ((DWORD)(tail - head) > capacity)
+		return luaL_error(L, "ring buffer is corrupted");
+
+	lua_newtable(L);
+	while (head != tail && (max <= 0 || n < max)) {
+		const DWORD pos = (DWORD)head & (capacity - 1);
+		const DWORD avail = (DWORD)(tail - head);
+		DWORD len;
+		if (pos + 4 > capacity)
+			return luaL_error(L, "ring buffer is corrupted");
+		len = *(const DWORD *)(rb->data + pos);
+		if (len == RING_WRAP) {
+			if (capacity - pos > avail)
+				return luaL_error(L, "ring buffer is corrupted");
+			head += capacity - pos;
+			continue;
+		}
+		// the record must lie inside the mapping and inside the published part
+		if (len > capacity - pos - 4 || 4 + RING_ALIGN(len) > avail)
+			return luaL_error(L, "ring buffer is corrupted");
+		lua_pushlstring(L, rb->data + pos + 4, len);
+		lua_rawseti(L, -2, ++n);
+		head += 4 + RING_ALIGN(len);
+	}
+	rb->hdr->head = head;   // release: the producer may reuse the space
+	lua_pushinteger(L, n);
+
+	return 2;
+}
+
+// Lua:  ring:wait(timeoutMs), consumer side; returns true when the ring is not empty
+static int ring_wait(lua_State *L) {
+	struct S_RINGBUFFER *rb = CheckRing(L);
+	const DWORD timeout = CheckWaitTimeout(L, 2);
+
+	if (rb->hdr->head == rb->hdr->tail && rb->event != NULL) {
+		// the producer checks waiting after publishing tail, so one of both sees the other
+		InterlockedExchange(&rb->hdr->waiting, 1);
+		if (rb->hdr->head == rb->hdr->tail)
+			WaitForSingleObject(rb->event, timeout);
+		InterlockedExchange(&rb->hdr->waiting, 0);
+	}
+	lua_pushboolean(L, rb->hdr->head != rb->hdr->tail);
+
+	return 1;
+}
+
+// Lua:  ring:used(), returns number of bytes used and capacity
+static int ring_used(lua_State *L) {
+	const struct S_RINGBUFFER *rb = CheckRing(L);
+
+	lua_pushinteger(L, (DWORD)(rb->hdr->tail - rb->hdr->head));
+	lua_pushinteger(L, rb->capacity);
+
+	return 2;
+}
+
+static int ring_close(lua_State *L) {
+	struct S_RINGBUFFER *rb = (struct S_RINGBUFFER *)luaL_checkudata(L, 1, RINGBUFFER_MT);
+
+	UnmapSharedMemory(&rb->shm);
+	if (rb->event != NULL) {
+		CloseHandle(rb->event);
+		rb->event = NULL;
+	}
+
+	return 0;
+}
+
+static int ring_tostring(lua_State *L) {
+	const struct S_RINGBUFFER *rb = (const struct S_RINGBUFFER *)luaL_checkudata(L, 1, RINGBUFFER_MT);
+
+	if (rb->shm.view != NULL)
+		lua_pushfstring(L, RINGBUFFER_MT ": %p (%d bytes)", (void *)rb->hdr, (int)rb->capacity);
+	else
+		lua_pushliteral(L, RINGBUFFER_MT ": closed");
+
+	return 1;
+}
+
+static const luaL_Reg ringbuffer_methods[] = {
+	{"push", ring_push},
+	{"pop", ring_pop},
+	{"wait", ring_wait},
+	{"used", ring_used},
+	{"close", ring_close},
+	{"__gc", ring_close},
+	{"__tostring", ring_tostring},
+	{NULL, NULL}
+};
 
-static int global_CreateFile(lua_State *L) {
-    SECURITY_ATTRIBUTES sa;
-    long h;
-    const char *name = luaL_checkstring( L, 1);
-    DWORD da = ( DWORD) luaL_checknumber( L, 2);
-    DWORD sm = ( DWORD) luaL_checknumber( L, 3);
-    DWORD cd = ( DWORD) luaL_checknumber( L, 5);
-    DWORD fa = ( DWORD) luaL_checknumber( L, 6);
-    long th = 0;
+static const luaL_Reg ringbuffer_lib[] = {
+	{"create", ring_create},
+	{"open", ring_open},
+	{NULL, NULL}
+};
 
-    sa.nLength = sizeof( sa);
-    sa.lpSecurityDescriptor = NULL;
-    sa.bInheritHandle = FALSE;
-    if( lua_istable( L, 4)) {
-        lua_pushstring( L, "bInheritHandle");
-        lua_gettable( L, 4);
-        if( !lua_isnil( L, -1))
-            sa.bInheritHandle = ( BOOL) luaL_checknumber( L, -1);
-        lua_pop( L, 1);
-    }
-    if( !lua_isnil( L, 7))
-        th = ( long) luaL_checknumber( L, 7);
+/* Latest-value snapshot table in shared memory: fixed open-addressed slots, each
+   guarded by a sequence lock. One writer updates slots without waiting, any number of
+   readers copy a slot and retry while its sequence is odd or has changed.
+   Slot: LONG seq, BYTE type, BYTE keyLen, WORD valueLen, key[SNAP_KEY_SIZE], value */
+
+#define SNAPSHOT_MT     "w32.SnapshotTable"
+#define SNAP_MAGIC      0x5453574C      // "LWST"
+#define SNAP_KEY_SIZE   32
+#define SNAP_SLOT_HDR   (8 + SNAP_KEY_SIZE)
+#define SNAP_STRING     1
+#define SNAP_NUMBERS    2               // array of doubles
+#define SNAP_MAXSPINS   0x10000         // reader retries before giving up on a slot
+
+struct S_SNAPHDR {
+	DWORD magic;
+	DWORD slots;            // power of 2
+	DWORD valueSize;        // multiple of 8
+	DWORD slotSize;         // multiple of 64
+	volatile LONG count;    // occupied slots
+	char pad[44];
+};
+
+struct S_SNAPSLOT {
+	volatile LONG seq;      // odd while the writer changes the slot
+	BYTE type;              // 0 - free
+	BYTE keyLen;
+	WORD valueLen;
+	char key[SNAP_KEY_SIZE];
+	// value follows
+};
+
+struct S_SNAPSHOT {
+	struct S_SHMEM shm;
+	struct S_SNAPHDR *hdr;
+	// checked copies of the header, which may come from another process
+	DWORD slots;
+	DWORD valueSize;
+	DWORD slotSize;
+};
 
-    h = ( long) CreateFile( name, da, sm, &sa, cd, fa, ( HANDLE) th);
+static struct S_SNAPSHOT *CheckSnapshot(lua_State *L) {
+	struct S_SNAPSHOT *st = (struct S_SNAPSHOT *)luaL_checkudata(L, 1, SNAPSHOT_MT);
 
-    lua_pushnumber( L, h);
+	if (st->shm.view == NULL)
+		luaL_error(L, "snapshot table is closed");
 
-    return( 1);
+	return st;
 }
-/***/
 
-/****if* luaw32/global_ReadFile
-* NAME
-*  global_ReadFile
-* FUNCTION
-*  Win32 ReadFile.
-* INPUTS
-*  L: Lua state
-*  stack[1]: Handle to the file to be read
-*  stack[2]: Specifies the number of bytes to be read from the file
-* RESULT
-*  stack[1]: True if ok.
-*  stack[2]: Buffer read or nil if error
-* SOURCE
-*/
+static struct S_SNAPSLOT *SnapSlot(const struct S_SNAPSHOT *st, DWORD i) {
+	return (struct S_SNAPSLOT *)((char *)st->hdr + sizeof(struct S_SNAPHDR) + (size_t)i * st->slotSize);
+}
 
-static int global_ReadFile(lua_State *L) {
-    DWORD bread;
-    char *buf;
-    BOOL brc = FALSE;
-    long h = MYP2HCAST luaL_checknumber( L, 1);
-    DWORD btoread = ( DWORD) luaL_checknumber( L, 2);
+// create: slots > 0; open: slots == 0
+static int OpenSnapshot(lua_State *L, const char *name, DWORD slots, DWORD valueSize) {
+	struct S_SNAPSHOT *st = (struct S_SNAPSHOT *)lua_newuserdata(L, sizeof(*st));
+	const DWORD slotSize = (SNAP_SLOT_HDR + valueSize + 63) & ~(DWORD)63;
 
-    buf = malloc( btoread);
-    if( buf != NULL) {
-        brc = ReadFile( ( HANDLE) h, buf, btoread, &bread, NULL);
-        lua_pushboolean( L, TRUE);
-        lua_pushlstring( L, buf, bread);
-        free( buf);
-    } else {
-        lua_pushboolean( L, FALSE);
-        lua_pushnil( L);
-    }
+	memset(st, 0, sizeof(*st));
+	if (!MapSharedMemory(name, slots ? sizeof(struct S_SNAPHDR) + (size_t)slots * slotSize : 0, &st->shm)) {
+		lua_pushnil(L);
+		lua_pushinteger(L, GetLastError());
+		return 2;
+	}
+	luaL_getmetatable(L, SNAPSHOT_MT);
+	lua_setmetatable(L, -2);
+	st->hdr = (struct S_SNAPHDR *)st->shm.view;
+
+	// a fresh mapping is zeroed, so all slots are free
+	if (slots && !(st->shm.existed && st->hdr->magic == SNAP_MAGIC)) {
+		st->hdr->slots = slots;
+		st->hdr->valueSize = valueSize;
+		st->hdr->slotSize = slotSize;
+		InterlockedExchange((volatile LONG *)&st->hdr->magic, SNAP_MAGIC);
+	}
+	st->slots = st->hdr->slots;
+	st->valueSize = st->hdr->valueSize;
+	st->slotSize = st->hdr->slotSize;
+	// every slot, with its value, must lie inside the mapping
+	if (st->hdr->magic != SNAP_MAGIC ||
+	    st->slots == 0 || (st->slots & (st->slots - 1)) != 0 ||
+	    st->valueSize > 0xFFFF || st->slotSize < SNAP_SLOT_HDR + st->valueSize || (st->slotSize & 7) != 0 ||
+	    st->shm.size < sizeof(struct S_SNAPHDR) ||
+	    (st->shm.size - sizeof(struct S_SNAPHDR)) / st->slots < st->slotSize) {
+		UnmapSharedMemory(&st->shm);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a snapshot table");
+		return 2;
+	}
 
-    return( 2);
+	return 1;
 }
-/***/
 
-/****if* luaw32/global_WriteFile
-* NAME
-*  global_WriteFile
-* FUNCTION
-*  Win32 WriteFile.
-* INPUTS
-*  L: Lua state
-*  stack[1]: Handle to the file to be written to
-*  stack[2]: Buffer containing the data to be written to the file
-* RESULT
-*  stack[1]: True if ok.
-*  stack[2]: Number of bytes written or nil if error
-* SOURCE
-*/
+// Lua:  SnapshotTable.create(name, slots, valueSize)
+//       slots is rounded up to a power of 2, valueSize (default 64) up to 8 bytes
+//       returns w32.SnapshotTable or nil, error
+static int snap_create(lua_State *L) {
+	const char *name = luaL_checkstring(L, 1);
+	const lua_Integer n = luaL_checkinteger(L, 2);
+	const lua_Integer size = luaL_optinteger(L, 3, 64);
+	DWORD slots = 16;
+
+	luaL_argcheck(L, n > 0 && n <= 0x100000, 2, "slot count out of range");
+	luaL_argcheck(L, size > 0 && size <= 0x8000, 3, "value size out of range");
+	while (slots < (DWORD)n)
+		slots <<= 1;
+
+	return OpenSnapshot(L, name, slots, ((DWORD)size + 7) & ~(DWORD)7);
+}
 
-static int global_WriteFile(lua_State *L) {
-    DWORD bwrite;
-    DWORD btowrite;
-    BOOL brc;
-    long h = MYP2HCAST luaL_checknumber( L, 1);
-    const char *buf = luaL_checklstring( L, 2, &btowrite);
+// Lua:  SnapshotTable.open(name)
+static int snap_open(lua_State *L) {
+	return OpenSnapshot(L, luaL_checkstring(L, 1), 0, 0);
+}
 
-    brc = WriteFile( ( HANDLE) h, buf, btowrite, &bwrite, NULL);
-    lua_pushboolean( L, brc);
-    if( brc)
-        lua_pushnumber( L, bwrite);
-    else
-        lua_pushnil( L);
+// returns slot holding key, or the free slot for it when insert is TRUE, or NULL
+// the writer is the only one changing keys, so it may read them without the sequence
+static struct S_SNAPSLOT *FindSnapSlot(const struct S_SNAPSHOT *st, const char *key, size_t len, BOOL insert) {
+	const DWORD mask = st->slots - 1;
+	DWORD i = HashBytes(FNV_OFFSET, key, len) & mask, probe;
+
+	for (probe = 0; probe <= mask; probe++, i = (i + 1) & mask) {
+		struct S_SNAPSLOT *slot = SnapSlot(st, i);
+		if (slot->type == 0)
+			return insert ? slot : NULL;
+		if (slot->keyLen == len && memcmp(slot->key, key, len) == 0)
+			return slot;
+	}
 
-    return( 2);
+	return NULL;
 }
-/***/
 
-static int global_WaitForSingleObject(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
-    DWORD t = ( DWORD) luaL_checknumber( L, 2);
+// Lua:  snap:set(key, value), value is a string or array of numbers; writer side
+//       returns false when the table is full
+static int snap_set(lua_State *L) {
+	struct S_SNAPSHOT *st = CheckSnapshot(L);
+	const DWORD valueSize = st->valueSize;
+	size_t keyLen, len = 0;
+	const char *key = luaL_checklstring(L, 2, &keyLen);
+	const char *s = NULL;
+	struct S_SNAPSLOT *slot;
+	double *numbers;
+	int n = 0, i;
+
+	luaL_argcheck(L, keyLen > 0 && keyLen <= SNAP_KEY_SIZE, 2, "key length out of range");
+	if (lua_istable(L, 3)) {
+		n = (int)lua_rawlen(L, 3);
+		len = n * sizeof(double);
+		// checked before the slot is opened: an error must not leave its sequence odd
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 3, i);
+			if (lua_type(L, -1) != LUA_TNUMBER)
+				return luaL_argerror(L, 3, "array of numbers expected");
+			lua_pop(L, 1);
+		}
+	}
+	else
+		s = luaL_checklstring(L, 3, &len);
+	luaL_argcheck(L, len <= valueSize, 3, "value is too long");
 
-    lua_pushnumber( L, WaitForSingleObject( ( HANDLE) h, t));
+	slot = FindSnapSlot(st, key, keyLen, TRUE);
+	if (slot == NULL) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
 
-    return( 1);
+	InterlockedIncrement(&slot->seq);   // odd, full barrier: the data is written after
+	if (slot->type == 0) {
+		memcpy(slot->key, key, keyLen);
+		slot->keyLen = (BYTE)keyLen;
+		InterlockedIncrement(&st->hdr->count);
+	}
+	numbers = (double *)(slot + 1);
+	if (s != NULL) {
+		slot->type = SNAP_STRING;
+		memcpy(numbers, s, len);
+	}
+	else {
+		slot->type = SNAP_NUMBERS;
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, 3, i + 1);
+			numbers[i] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+	}
+	slot->valueLen = (WORD)len;
+	slot->seq = slot->seq + 1;          // even, release: the data is visible before
+
+	lua_pushboolean(L, 1);
+
+	return 1;
 }
 
-static int global_WaitForMultipleObjects(lua_State *L) {
-    HANDLE ha[64];
-    DWORD c = 0;
-    BOOL wa = ( BOOL) luaL_checknumber( L, 2);
-    DWORD t = ( DWORD) luaL_checknumber( L, 3);
+// Lua:  snap:get(key), reader side
+//       returns the string, or the numbers, of a consistent copy of the slot; nil when absent
+//       nil, "busy" when the slot stays locked, e.g. the writer died in the middle of an update
+static int snap_get(lua_State *L) {
+	struct S_SNAPSHOT *st = CheckSnapshot(L);
+	size_t keyLen;
+	const char *key = luaL_checklstring(L, 2, &keyLen);
+	const DWORD mask = st->slots - 1;
+	DWORD i = HashBytes(FNV_OFFSET, key, keyLen) & mask, probe;
+	double buf[64];
+	void *copy = buf;
+	int spins = 0;
+
+	// stays on the stack below the results, so it is alive while they are pushed
+	if (st->valueSize > sizeof(buf))
+		copy = lua_newuserdata(L, st->valueSize);
+
+	for (probe = 0; probe <= mask && keyLen <= SNAP_KEY_SIZE; probe++, i = (i + 1) & mask) {
+		const struct S_SNAPSLOT *slot = SnapSlot(st, i);
+		struct S_SNAPSLOT head;
+		LONG seq;
+
+		do {
+			while ((seq = slot->seq) & 1) {     // acquire
+				if (++spins > SNAP_MAXSPINS) {
+					lua_pushnil(L);
+					lua_pushliteral(L, "busy");
+					return 2;
+				}
+				YieldProcessor();
+			}
+			memcpy(&head, slot, sizeof(head));
+			if (head.type != 0 && head.keyLen == keyLen && head.valueLen <= st->valueSize)
+				memcpy(copy, slot + 1, head.valueLen);
+			MemoryBarrier();    // the copies complete before seq is read again
+		} while (slot->seq != seq && ++spins <= SNAP_MAXSPINS);
+
+		if (spins > SNAP_MAXSPINS) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "busy");
+			return 2;
+		}
+		if (head.type == 0)
+			break;
+		if (head.keyLen != keyLen || memcmp(head.key, key, keyLen) != 0)
+			continue;
+		if (head.valueLen > st->valueSize)
+			return luaL_error(L, "snapshot table is corrupted");
+
+		if (head.type == SNAP_STRING) {
+			lua_pushlstring(L, (const char *)copy, head.valueLen);
+			return 1;
+		}
+		else {
+			const int n = head.valueLen / sizeof(double);
+			int k;
+			luaL_checkstack(L, n, "too many numbers");
+			for (k = 0; k < n; k++)
+				lua_pushnumber(L, ((const double *)copy)[k]);
+			return n;
+		}
+	}
+	lua_pushnil(L);
 
-    if( lua_istable( L, 1)) {
-        for( ;c < 64; c++) {
-            long h;
-            lua_pushnumber( L, c + 1);
-            lua_gettable( L, 1);
-            if( lua_isnil( L, -1))
-                break;
-            h = ( long) luaL_checknumber( L, -1);
-            ha[c] = ( HANDLE) h;
-        }
-    }
+	return 1;
+}
 
-    lua_pushnumber( L, WaitForMultipleObjects( c, ha, wa, t));
+// Lua:  snap:count(), returns number of keys and number of slots
+static int snap_count(lua_State *L) {
+	const struct S_SNAPSHOT *st = CheckSnapshot(L);
 
-    return( 1);
+	lua_pushinteger(L, st->hdr->count);
+	lua_pushinteger(L, st->slots);
+
+	return 2;
+}
+
+static int snap_close(lua_State *L) {
+	UnmapSharedMemory(&((struct S_SNAPSHOT *)luaL_checkudata(L, 1, SNAPSHOT_MT))->shm);
+	return 0;
+}
+
+static int snap_tostring(lua_State *L) {
+	const struct S_SNAPSHOT *st = (const struct S_SNAPSHOT *)luaL_checkudata(L, 1, SNAPSHOT_MT);
+
+	if (st->shm.view != NULL)
+		lua_pushfstring(L, SNAPSHOT_MT ": %p (%d slots)", (void *)st->hdr, (int)st->slots);
+	else
+		lua_pushliteral(L, SNAPSHOT_MT ": closed");
+
+	return 1;
 }
 
+static const luaL_Reg snapshot_methods[] = {
+	{"set", snap_set},
+	{"get", snap_get},
+	{"count", snap_count},
+	{"close", snap_close},
+	{"__gc", snap_close},
+	{"__tostring", snap_tostring},
+	{NULL, NULL}
+};
+
+static const luaL_Reg snapshot_lib[] = {
+	{"create", snap_create},
+	{"open", snap_open},
+	{NULL, NULL}
+};
+
 static int global_TerminateProcess(lua_State *L) {
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+    HANDLE h = CheckHandle( L, 1);
     DWORD ec = ( DWORD) luaL_checknumber( L, 2);
 
     lua_pushnumber( L, TerminateProcess( ( HANDLE) h, ec));
@@ -960,7 +5399,7 @@ static int global_TerminateProcess(lua_State *L) {
 static int global_GetExitCodeProcess(lua_State *L) {
     BOOL ok;
     DWORD ec;
-    long h = MYP2HCAST luaL_checknumber( L, 1);
+    HANDLE h = CheckHandle( L, 1);
 
     ok = GetExitCodeProcess( ( HANDLE) h, &ec);
     lua_pushnumber( L, ok);
@@ -1187,6 +5626,233 @@ static int global_Sleep(lua_State *L) {
     return 0;
 }
 
+/* Waitable timers: high resolution ones (Windows 10 1803+) are not bound to the
+   system timer tick, older systems fall back to a regular waitable timer */
+
+#define TIMER_MT        "w32.Timer"
+#define TIMEPERIOD_MT   "w32.TimePeriod"
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+
+struct S_TIMER {
+	HANDLE h;               // NULL when closed
+	BOOL highResolution;
+};
+
+static BOOL CreateTimerHandle(struct S_TIMER *t) {
+	t->h = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	t->highResolution = t->h != NULL;
+	if (t->h == NULL)
+		t->h = CreateWaitableTimerEx(NULL, NULL, 0, TIMER_ALL_ACCESS);
+
+	return t->h != NULL;
+}
+
+// due in microseconds from now, period in milliseconds (0 - one-shot)
+static BOOL SetTimerHandle(const struct S_TIMER *t, lua_Number dueUs, LONG periodMs) {
+	LARGE_INTEGER due;
+
+	due.QuadPart = -(LONGLONG)(dueUs * 10);     // relative, in 100 ns units
+	if (due.QuadPart == 0)
+		due.QuadPart = -1;
+
+	return SetWaitableTimer(t->h, &due, periodMs, NULL, NULL, FALSE);
+}
+
+static struct S_TIMER *CheckTimer(lua_State *L) {
+	struct S_TIMER *t = (struct S_TIMER *)luaL_checkudata(L, 1, TIMER_MT);
+
+	if (t->h == NULL)
+		luaL_error(L, "timer is closed");
+
+	return t;
+}
+
+// Lua:  CreateTimer(), returns w32.Timer or nil, error code
+static int global_CreateTimer(lua_State *L) {
+	struct S_TIMER *t = (struct S_TIMER *)lua_newuserdata(L, sizeof(*t));
+
+	if (!CreateTimerHandle(t)) {
+		lua_pushnil(L);
+		lua_pushinteger(L, GetLastError());
+		return 2;
+	}
+	luaL_getmetatable(L, TIMER_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+// Lua:  timer:set(dueUs, periodMs), periodMs = nil or 0 - one-shot
+static int timer_set(lua_State *L) {
+	const struct S_TIMER *t = CheckTimer(L);
+	const lua_Number due = luaL_checknumber(L, 2);
+	const LONG period = (LONG)luaL_optinteger(L, 3, 0);
+
+	lua_pushboolean(L, SetTimerHandle(t, due, period));
+
+	return 1;
+}
+
+// Lua:  timer:wait(timeoutMs), timeoutMs = nil or -1 - infinite; returns true when the timer fired
+static int timer_wait(lua_State *L) {
+	const struct S_TIMER *t = CheckTimer(L);
+
+	lua_pushboolean(L, WaitForSingleObject(t->h, CheckWaitTimeout(L, 2)) == WAIT_OBJECT_0);
+
+	return 1;
+}
+
+static int timer_cancel(lua_State *L) {
+	lua_pushboolean(L, CancelWaitableTimer(CheckTimer(L)->h));
+	return 1;
+}
+
+// Lua:  timer:value(), the handle as a number for WaitAny and WaitForMultipleObjects
+static int timer_value(lua_State *L) {
+	lua_pushint64(L, (lua_Integer)(INT_PTR)CheckTimer(L)->h);
+	return 1;
+}
+
+static int timer_isHighResolution(lua_State *L) {
+	lua_pushboolean(L, CheckTimer(L)->highResolution);
+	return 1;
+}
+
+static int timer_close(lua_State *L) {
+	struct S_TIMER *t = (struct S_TIMER *)luaL_checkudata(L, 1, TIMER_MT);
+
+	if (t->h != NULL) {
+		CloseHandle(t->h);
+		t->h = NULL;
+	}
+
+	return 0;
+}
+
+static int timer_tostring(lua_State *L) {
+	const struct S_TIMER *t = (const struct S_TIMER *)luaL_checkudata(L, 1, TIMER_MT);
+
+	if (t->h != NULL)
+		lua_pushfstring(L, TIMER_MT " (%s): %p", t->highResolution ? "high resolution" : "default", (void *)t->h);
+	else
+		lua_pushliteral(L, TIMER_MT ": closed");
+
+	return 1;
+}
+
+static const luaL_Reg timer_methods[] = {
+	{"set", timer_set},
+	{"wait", timer_wait},
+	{"cancel", timer_cancel},
+	{"value", timer_value},
+	{"isHighResolution", timer_isHighResolution},
+	{"close", timer_close},
+	{"__gc", timer_close},
+	{"__close", timer_close},
+	{"__tostring", timer_tostring},
+	{NULL, NULL}
+};
+
+static LONGLONG QpcMicroseconds(void) {
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);   // fixed at boot, a race only repeats the call
+	QueryPerformanceCounter(&now);
+
+	return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
+
+// one sleep timer per OS thread: main() and callbacks of a script run on different
+// threads and must not re-arm each other's timer; DllMain closes it on thread exit.
+// __declspec(thread) in a module loaded by LoadLibrary needs Windows Vista or later,
+// as do the SRW locks and condition variables of this module
+static __declspec(thread) struct S_TIMER sleepTimer;
+
+BOOL WINAPI DllMain(HINSTANCE hinst, DWORD reason, LPVOID reserved) {
+	// on process exit (reserved != NULL) the handles go with the process
+	if (sleepTimer.h != NULL && (reason == DLL_THREAD_DETACH ||
+	                             (reason == DLL_PROCESS_DETACH && reserved == NULL))) {
+		CloseHandle(sleepTimer.h);
+		sleepTimer.h = NULL;
+	}
+
+	return TRUE;
+}
+
+// Lua:  SleepPrecise(us)
+//       sleeps on a timer until shortly before the deadline, then spins the rest;
+//       the spin tail is shorter with a high resolution timer, a regular one is
+//       waited under timeBeginPeriod(1) so that its 2 ms margin covers the tick
+static int global_SleepPrecise(lua_State *L) {
+	const lua_Number us = luaL_checknumber(L, 1);
+	const LONGLONG deadline = QpcMicroseconds() + (LONGLONG)us;
+	LONGLONG left, margin;
+
+	if (sleepTimer.h == NULL && !CreateTimerHandle(&sleepTimer)) {
+		Sleep((DWORD)(us / 1000));
+		return 0;
+	}
+
+	margin = sleepTimer.highResolution ? 200 : 2000;
+	left = deadline - QpcMicroseconds();
+	if (left > margin) {
+		const BOOL period = !sleepTimer.highResolution && timeBeginPeriod(1) == TIMERR_NOERROR;
+
+		// bounded wait: a lost signal costs at most a millisecond past the deadline
+		if (SetTimerHandle(&sleepTimer, (lua_Number)(left - margin), 0))
+			WaitForSingleObject(sleepTimer.h, (DWORD)(left / 1000) + 1);
+		if (period)
+			timeEndPeriod(1);
+	}
+
+	while (QpcMicroseconds() < deadline)
+		YieldProcessor();
+
+	return 0;
+}
+
+// Lua:  BeginTimePeriod(ms), returns w32.TimePeriod; its release(), __gc or __close
+//       (local p <close> = w32.BeginTimePeriod(1)) calls timeEndPeriod
+static int global_BeginTimePeriod(lua_State *L) {
+	const UINT ms = (UINT)luaL_checkinteger(L, 1);
+	UINT *period;
+
+	if (timeBeginPeriod(ms) != TIMERR_NOERROR) {
+		lua_pushnil(L);
+		lua_pushstring(L, "timeBeginPeriod failed");
+		return 2;
+	}
+	period = (UINT *)lua_newuserdata(L, sizeof(UINT));
+	*period = ms;
+	luaL_getmetatable(L, TIMEPERIOD_MT);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int timeperiod_release(lua_State *L) {
+	UINT *period = (UINT *)luaL_checkudata(L, 1, TIMEPERIOD_MT);
+
+	if (*period != 0) {
+		timeEndPeriod(*period);
+		*period = 0;
+	}
+
+	return 0;
+}
+
+static const luaL_Reg timeperiod_methods[] = {
+	{"release", timeperiod_release},
+	{"__gc", timeperiod_release},
+	{"__close", timeperiod_release},
+	{NULL, NULL}
+};
+
 static int global_GetVersion(lua_State *L) {
 
     lua_pushnumber( L, GetVersion());
@@ -1257,11 +5923,11 @@ static int global_FindFirstFile(lua_State *L) {
     const char *fname = luaL_checkstring( L, 1);
 
     hfd = FindFirstFile( fname, &wfd);
-    if( hfd == NULL) {
+    if( hfd == NULL || hfd == INVALID_HANDLE_VALUE) {
         lua_pushnumber( L, 0);
         lua_pushnil( L);
     } else {
-        lua_pushnumber( L, ( long) hfd);
+        PushHandle( L, hfd, HANDLE_FIND, "find");
         pushFFData( L, &wfd);
     }
 
@@ -1271,9 +5937,9 @@ static int global_FindFirstFile(lua_State *L) {
 static int global_FindNextFile(lua_State *L) {
     WIN32_FIND_DATA wfd;
     BOOL ok;
-    long lfd = MYP2HCAST luaL_checknumber( L, 1);
+    HANDLE lfd = CheckHandle( L, 1);
 
-    ok = FindNextFile( ( HANDLE) lfd, &wfd);
+    ok = FindNextFile( lfd, &wfd);
     lua_pushboolean( L, ok);
     if( !ok) {
         lua_pushnil( L);
@@ -1285,11 +5951,7 @@ static int global_FindNextFile(lua_State *L) {
 }
 
 static int global_FindClose(lua_State *L) {
-    long lfd = MYP2HCAST luaL_checknumber( L, 1);
-
-    lua_pushboolean( L, FindClose( ( HANDLE) lfd));
-
-    return( 2);
+    return CloseAnyHandle( L, HANDLE_FIND);
 }
 
 static void FreePIDL( LPITEMIDLIST idl) {
@@ -1375,7 +6037,7 @@ static int global_OpenProcess( lua_State *L ) {
 
     h = OpenProcess( da, ih, pid );
     if( h != NULL )
-        lua_pushnumber( L, ( long ) h );
+        PushHandle( L, h, HANDLE_KERNEL, "process" );
     else
         lua_pushnil( L );
 
@@ -1413,34 +6075,36 @@ static int global_OpenSCManager( lua_State *L ) {
     SC_HANDLE h;
 
     h = OpenSCManager( NULL, NULL, SC_MANAGER_ALL_ACCESS );
-    lua_pushnumber( L, ( long ) h );
+    if( h != NULL )
+        PushHandle( L, ( HANDLE ) h, HANDLE_SERVICE, "scmanager" );
+    else
+        lua_pushnumber( L, 0 );
 
     return 1;
 }
 
 static int global_OpenService( lua_State *L ) {
     SC_HANDLE h;
-    long scm = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE scm = CheckHandle( L, 1 );
     const char *sname = luaL_checkstring( L, 2 );
 
     h = OpenService( ( SC_HANDLE ) scm, sname, SERVICE_ALL_ACCESS );
-    lua_pushnumber( L, ( long ) h );
+    if( h != NULL )
+        PushHandle( L, ( HANDLE ) h, HANDLE_SERVICE, "service" );
+    else
+        lua_pushnumber( L, 0 );
 
     return 1;
 }
 
 static int global_CloseServiceHandle( lua_State *L ) {
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
-
-    lua_pushboolean( L, CloseServiceHandle( ( SC_HANDLE ) h ) );
-
-    return 1;
+    return CloseAnyHandle( L, HANDLE_SERVICE );
 }
 
 static int global_QueryServiceStatus( lua_State *L ) {
     SERVICE_STATUS ss;
     BOOL brc;
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE h = CheckHandle( L, 1 );
 
     brc = QueryServiceStatus( ( SC_HANDLE ) h, &ss );
     lua_pushboolean( L, brc );
@@ -1464,7 +6128,7 @@ static int global_QueryServiceConfig( lua_State *L ) {
     } storage;
     BOOL brc;
     DWORD needed = 0, errcode = 0;
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE h = CheckHandle( L, 1 );
 
     brc = QueryServiceConfig( ( SC_HANDLE ) h, ( LPQUERY_SERVICE_CONFIG ) &storage, sizeof( storage ), &needed );
     if( !brc ) {
@@ -1489,7 +6153,7 @@ static int global_QueryServiceConfig( lua_State *L ) {
 static int global_ControlService( lua_State *L ) {
     SERVICE_STATUS ss;
     BOOL brc;
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE h = CheckHandle( L, 1 );
     DWORD c = ( DWORD ) luaL_checknumber( L, 2 );
 
     brc = ControlService( ( SC_HANDLE ) h, c, &ss );
@@ -1499,7 +6163,7 @@ static int global_ControlService( lua_State *L ) {
 }
 
 static int global_DeleteService( lua_State *L ) {
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE h = CheckHandle( L, 1 );
 
     lua_pushboolean( L, DeleteService( ( SC_HANDLE ) h ) );
 
@@ -1507,7 +6171,7 @@ static int global_DeleteService( lua_State *L ) {
 }
 
 static int global_StartService( lua_State *L ) {
-    long h = MYP2HCAST luaL_checknumber( L, 1 );
+    HANDLE h = CheckHandle( L, 1 );
 
     lua_pushboolean( L, StartService( ( SC_HANDLE ) h, 0, NULL ) );
 
@@ -1586,6 +6250,37 @@ static int global_IsWindowVisible(lua_State *L) {
 	return(1);
 }
 
+// Lua:  CreateWindowEx(exStyle, className, windowName, style, x, y, width, height, parent = 0)
+//       returns hwnd of a window owned by the calling thread or 0
+static int global_CreateWindowEx(lua_State *L) {
+	const DWORD exStyle = (DWORD)luaL_checkinteger(L, 1);
+	const char *cname = luaL_checkstring(L, 2);
+	const char *wname = luaL_checkstring(L, 3);
+	const DWORD style = (DWORD)luaL_checkinteger(L, 4);
+	const int x = (int)luaL_checkinteger(L, 5);
+	const int y = (int)luaL_checkinteger(L, 6);
+	const int w = (int)luaL_checkinteger(L, 7);
+	const int h = (int)luaL_checkinteger(L, 8);
+	const HWND parent = (HWND)(lua_Integer)luaL_optinteger(L, 9, 0);
+
+	lua_pushhwnd(L, CreateWindowEx(exStyle, cname, wname, style, x, y, w, h, parent, NULL, GetModuleHandle(NULL), NULL));
+	return(1);
+}
+
+static int global_DestroyWindow(lua_State *L) {
+	const HWND hWnd = (HWND)(lua_Integer)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, DestroyWindow(hWnd));
+	return(1);
+}
+
+// Lua:  InvalidateRect(hwnd, erase = true), invalidates the whole client area
+static int global_InvalidateRect(lua_State *L) {
+	const HWND hWnd = (HWND)(lua_Integer)luaL_checkinteger(L, 1);
+	const BOOL erase = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+	lua_pushboolean(L, InvalidateRect(hWnd, NULL, erase));
+	return(1);
+}
+
 static int global_TabCtrl_GetItemCount(lua_State *L) {
 	const HWND hWnd = (HWND)(lua_Integer)luaL_checkinteger(L, 1);
 	lua_pushinteger(L, TabCtrl_GetItemCount(hWnd));
@@ -1610,6 +6305,22 @@ static int global_TabCtrl_GetItemText(lua_State *L) {
 	const int narg = lua_gettop(L);
 	const HWND hWnd = (HWND)(lua_Integer)luaL_checkinteger(L, 1);
 	const int i = narg > 1 ? luaL_checkinteger(L, 2) : TabCtrl_GetCurFocus(hWnd);
+	const UINT cp = GetScriptCodePage(L);
+
+	if (cp) {
+		WCHAR wbuf[256];
+		TCITEMW witem;
+		memset(&witem, 0, sizeof(witem));
+		witem.mask = TCIF_TEXT;
+		witem.pszText = wbuf;
+		witem.cchTextMax = sizeof(wbuf) / sizeof(wbuf[0]);
+		wbuf[0] = 0;
+		if (SendMessage(hWnd, TCM_GETITEMW, i, (LPARAM)&witem))
+			PushWide(L, cp, witem.pszText, (int)wcslen(witem.pszText));
+		else
+			lua_pushnil(L);
+		return(1);
+	}
 
 	char buf[256];
 	buf[0] = '\0';
@@ -1626,13 +6337,80 @@ static int global_TabCtrl_GetItemText(lua_State *L) {
 	return(1);
 }
 
+// Lua:  TabCtrl_GetItemTextTimeout(hwnd, i, timeoutMs), i = nil - tab with focus
+//       returns text or nil, "timeout" | "error" | "busy"
+static int global_TabCtrl_GetItemTextTimeout(lua_State *L) {
+	const HWND hWnd = lua_checkhwnd(L, 1);
+	const UINT timeout = (UINT)luaL_optinteger(L, 3, SEND_TIMEOUT_DEFAULT);
+	const UINT cp = GetTextCodePage(L);
+	const DWORD start = GetTickCount();
+	struct {
+		TCITEMW citem;
+		WCHAR buf[256];
+	} *item;
+	DWORD_PTR i, rc;
+	BOOL timedOut;
+
+	if (!lua_isnoneornil(L, 2))
+		i = (DWORD_PTR)luaL_checkinteger(L, 2);
+	else if (!SendMessageBounded(hWnd, TCM_GETCURFOCUS, 0, 0, SMTO_ABORTIFHUNG, timeout, &i, &timedOut))
+		return PushSendFailure(L, timedOut);
+
+	// TCM_GETITEM is not marshalled, so the item lives on the heap
+	if (LateBuffersBusy())
+		return PushLateBuffersBusy(L);
+	item = malloc(sizeof(*item));
+	if (item == NULL)
+		return PushSendFailure(L, FALSE);
+	memset(item, 0, sizeof(*item));
+	item->citem.mask = TCIF_TEXT;
+	item->citem.pszText = item->buf;
+	item->citem.cchTextMax = sizeof(item->buf) / sizeof(item->buf[0]);
+
+	if (!SendMessageBounded(hWnd, TCM_GETITEMW, (WPARAM)i, (LPARAM)&item->citem, SMTO_ABORTIFHUNG,
+	                        RemainingTimeout(timeout, start), &rc, &timedOut) || !rc) {
+		// the target may still fill the item after the timeout
+		if (timedOut)
+			ReleaseLateBuffer(hWnd, item);
+		else
+			free(item);
+		return PushSendFailure(L, timedOut);
+	}
+
+	PushWide(L, cp, item->citem.pszText, (int)wcslen(item->citem.pszText));
+	free(item);
+
+	return 1;
+}
+
 static int global_TabCtrl_GetItemIndexByText(lua_State *L) {
 	const HWND hWnd = (HWND)(lua_Integer)luaL_checkinteger(L, 1);
 	const char *szText = luaL_checkstring(L, 2);
+	const UINT cp = GetScriptCodePage(L);
 
 	const int cnt = TabCtrl_GetItemCount(hWnd);
 	int numItem = -1;
 
+	if (cp) {
+		const WCHAR *wtext = PushWideName(L, cp, szText);
+		for (int i = 0; i < cnt && wtext != NULL; ++i) {
+			WCHAR wbuf[256];
+			TCITEMW witem;
+			memset(&witem, 0, sizeof(witem));
+			witem.mask = TCIF_TEXT;
+			witem.pszText = wbuf;
+			witem.cchTextMax = sizeof(wbuf) / sizeof(wbuf[0]);
+			wbuf[0] = 0;
+			if (SendMessage(hWnd, TCM_GETITEMW, i, (LPARAM)&witem))
+				if (wcsncmp(witem.pszText, wtext, sizeof(wbuf) / sizeof(wbuf[0])) == 0) {
+					numItem = i;
+					break;
+				}
+		}
+		lua_pushinteger(L, numItem);
+		return(1);
+	}
+
 	for (int i = 0; i < cnt; ++i) {
 		char buf[256];
 		buf[0] = '\0';
@@ -1820,6 +6598,18 @@ static struct {
 		{"WM_COMMAND", WM_COMMAND},
 		{"WM_SYSCOMMAND", WM_SYSCOMMAND},
 		{"WM_CLOSE", WM_CLOSE},
+		{"WM_PAINT", WM_PAINT},
+		{"WM_USER", WM_USER},
+		{"WS_POPUP", WS_POPUP},
+		{"WS_VISIBLE", WS_VISIBLE},
+		{"WS_EX_TOOLWINDOW", WS_EX_TOOLWINDOW},
+		{"WS_EX_NOACTIVATE", WS_EX_NOACTIVATE},
+
+		{"SMTO_NORMAL", SMTO_NORMAL},
+		{"SMTO_BLOCK", SMTO_BLOCK},
+		{"SMTO_ABORTIFHUNG", SMTO_ABORTIFHUNG},
+		{"SMTO_NOTIMEOUTIFNOTHUNG", SMTO_NOTIMEOUTIFNOTHUNG},
+		{"SMTO_ERRORONEXIT", SMTO_ERRORONEXIT},
 
 		{NULL,0}
     };
@@ -1828,22 +6618,56 @@ static struct luaL_Reg ls_lib[] = {
     {"ShellOpen", global_ShellOpen},
     {"FindWindow", global_FindWindow},
     {"FindWindowEx", global_FindWindowEx},
+    {"GetChildWindows", global_GetChildWindows},
+    {"GetChildByIndex", global_GetChildByIndex},
+    {"EnumWindowsSnapshot", global_EnumWindowsSnapshot},
+    {"FindWindowsByProcess", global_FindWindowsByProcess},
+    {"FindWindowCached", global_FindWindowCached},
+    {"GetWindowCacheStats", global_GetWindowCacheStats},
+    {"FlushWindowCache", global_FlushWindowCache},
+    {"WaitForWindow", global_WaitForWindow},
+    {"CompileSelector", global_CompileSelector},
+    {"compileSelector", global_CompileSelector},  // alias
+    {"CreateWindowTracker", global_CreateWindowTracker},
     {"SetFocus", global_SetFocus},
     {"GetWindowText", global_GetWindowText},
+    {"GetWindowTexts", global_GetWindowTexts},
+    {"SetScriptEncoding", global_SetScriptEncoding},
+    {"Utf8ToCp1251", global_Utf8ToCp1251},
+    {"Cp1251ToUtf8", global_Cp1251ToUtf8},
+    {"GetWindowTextTimeout", global_GetWindowTextTimeout},
     {"SetWindowText", global_SetWindowText},
     {"GetWindowRect", global_GetWindowRect},
     {"RegisterHotKey", global_RegisterHotKey},
+    {"UnregisterHotKey", global_UnregisterHotKey},
+    {"PollHotKeys", global_PollHotKeys},
     {"SetForegroundWindow", global_SetForegroundWindow},
     {"PostMessage", global_PostMessage},
 	{"SendMessage", global_SendMessage},
+	{"SendMessageTimeout", global_SendMessageTimeout},
+	{"SendCopyData", global_SendCopyData},
+	{"SendMessageAsync", global_SendMessageAsync},
+	{"PollCompletions", global_PollCompletions},
+	{"CloseCompletions", global_CloseCompletions},
+	{"PostMessages", global_PostMessages},
+	{"SendMessages", global_SendMessages},
     {"PostThreadMessage", global_PostThreadMessage},
     {"GetMessage", global_GetMessage},
     {"PeekMessage", global_PeekMessage},
+    {"PeekMessages", global_PeekMessages},
+    {"newMsg", global_newMsg},
     {"ReplyMessage", global_ReplyMessage},
     {"DispatchMessage", global_DispatchMessage},
+    {"PumpMessages", global_PumpMessages},
+    {"SubclassWindow", global_SubclassWindow},
+    {"UnsubclassWindow", global_UnsubclassWindow},
+    {"GetSubclassError", global_GetSubclassError},
+    {"CreateIpcWindow", global_CreateIpcWindow},
+    {"SetMessageFilter", global_SetMessageFilter},
     {"SetTopmost", global_SetTopmost},
     {"GetLastError", global_GetLastError},
     {"CloseHandle", global_CloseHandle},
+    {"SetHandleMode", global_SetHandleMode},
     {"CreateEvent", global_CreateEvent},
     {"OpenEvent", global_OpenEvent},
     {"PulseEvent", global_PulseEvent},
@@ -1865,6 +6689,13 @@ static struct luaL_Reg ls_lib[] = {
     {"GetExitCodeProcess", global_GetExitCodeProcess},
     {"WaitForSingleObject",global_WaitForSingleObject},
     {"WaitForMultipleObjects",global_WaitForMultipleObjects},
+    {"WaitAny", global_WaitAny},
+    {"WaitAll", global_WaitAll},
+    {"CreateSRWLock", global_CreateSRWLock},
+    {"CreateCriticalSection", global_CreateCriticalSection},
+    {"CreateConditionVariable", global_CreateConditionVariable},
+    {"CreateSharedMemory", global_CreateSharedMemory},
+    {"OpenSharedMemory", global_OpenSharedMemory},
     {"GetCurrentThreadId",global_GetCurrentThreadId},
     {"RegisterWindowMessage",global_RegisterWindowMessage},
     {"RegQueryValueEx",global_RegQueryValueEx},
@@ -1876,6 +6707,9 @@ static struct luaL_Reg ls_lib[] = {
     {"SetCurrentDirectory",global_SetCurrentDirectory},
     {"SHDeleteKey",global_SHDeleteKey},
     {"Sleep",global_Sleep},
+    {"SleepPrecise",global_SleepPrecise},
+    {"CreateTimer",global_CreateTimer},
+    {"BeginTimePeriod",global_BeginTimePeriod},
     {"GetVersion",global_GetVersion},
     {"FindFirstFile", global_FindFirstFile},
     {"FindNextFile", global_FindNextFile},
@@ -1903,10 +6737,14 @@ static struct luaL_Reg ls_lib[] = {
     {"GetCurrentProcessId",global_GetCurrentProcessId},
     {"CloseWindow",global_CloseWindow},
 	{"IsWindowVisible",global_IsWindowVisible},
+	{"CreateWindowEx",global_CreateWindowEx},
+	{"DestroyWindow",global_DestroyWindow},
+	{"InvalidateRect",global_InvalidateRect},
 	{"TabCtrl_GetItemCount",global_TabCtrl_GetItemCount},
 	{"TabCtrl_SetCurFocus",global_TabCtrl_SetCurFocus},
 	{"TabCtrl_SetCurSel",global_TabCtrl_SetCurSel},
 	{"TabCtrl_GetItemText",global_TabCtrl_GetItemText},
+	{"TabCtrl_GetItemTextTimeout",global_TabCtrl_GetItemTextTimeout},
 	{"TabCtrl_GetItemIndexByText",global_TabCtrl_GetItemIndexByText},
 	{"TabCtrl_GetCurSel",global_TabCtrl_GetCurSel},
 	{"TabCtrl_GetCurFocus",global_TabCtrl_GetCurFocus},
@@ -1926,5 +6764,30 @@ LUAW32_API int luaopen_w32( lua_State *L) {
         lua_settable( L, -3);
     }
 
+	NewClass(L, SELECTOR_MT, selector_methods);
+	NewClass(L, TRACKER_MT, tracker_methods);
+	NewClass(L, HOTKEY_MT, hotkeyqueue_methods);
+	NewClass(L, MSG_MT, msg_methods);
+	NewClass(L, SUBCLASS_GC_MT, subclass_guard_methods);
+	NewClass(L, IPC_MT, ipc_methods);
+	NewClass(L, HANDLE_MT, handle_methods);
+	NewClass(L, SRWLOCK_MT, srwlock_methods);
+	NewClass(L, CRITSEC_MT, critsec_methods);
+	NewClass(L, CONDVAR_MT, condvar_methods);
+	NewClass(L, LOCKGUARD_MT, lockguard_methods);
+	NewClass(L, SHMEM_MT, shmem_methods);
+	NewClass(L, RINGBUFFER_MT, ringbuffer_methods);
+	NewClass(L, SNAPSHOT_MT, snapshot_methods);
+	NewClass(L, TIMER_MT, timer_methods);
+	NewClass(L, TIMEPERIOD_MT, timeperiod_methods);
+
+	lua_newtable(L);
+	lua_setfuncs(L, ringbuffer_lib);
+	lua_setfield(L, -2, "RingBuffer");
+
+	lua_newtable(L);
+	lua_setfuncs(L, snapshot_lib);
+	lua_setfield(L, -2, "SnapshotTable");
+
 	return 1;
 }